@@ -0,0 +1,58 @@
+#!/bin/sh
+# Replay the standard key scripts against generated files with kilo's
+# headless mode and print the per key latency report of every scenario.
+#
+# BENCH_LINES   rows in the generated files (default 200000)
+# BENCH_SIZE    virtual terminal size (default 50x160)
+# BENCH_DIR     where the files and scripts go (default bench/out)
+set -e
+
+KILO=${KILO:-./kilo}
+LINES=${BENCH_LINES:-200000}
+SIZE=${BENCH_SIZE:-50x160}
+DIR=${BENCH_DIR:-bench/out}
+mkdir -p "$DIR"
+
+# C with comments, strings, numbers, keywords and tabs
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 50 == 0) print "/* block " i " starts here"
+        else if (i % 50 == 3) print " * and ends here */"
+        else if (i % 7 == 0) print "\tif (x" i " > " i * 3 ") return \"value " i "\"; // done"
+        else print "\tint var" i " = " i " + foo(bar, " i % 13 ", 0.5);"
+    }
+}' > "$DIR/large.c"
+
+# log lines far wider than the screen
+awk -v n="$LINES" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "2024-01-01T00:00:%02d.%06d INFO request id=%d", i % 60, i, i
+        for (j = 0; j < 20; j++) printf " key%d=value%d", j, i * j
+        printf "\n"
+    }
+}' > "$DIR/long.log"
+
+# repeat KEYS COUNT: emit KEYS (awk escapes allowed) COUNT times
+repeat() {
+    awk -v n="$2" "BEGIN { for (i = 0; i < n; i++) printf \"$1\" }"
+}
+
+repeat '\033[B' 5000 > "$DIR/scroll-lines.keys"
+repeat '\033[6~' 500 > "$DIR/scroll-pages.keys"
+{ repeat '\033[6~' 100; repeat 'int x = 42; ' 200; } > "$DIR/typing.keys"
+# a search that finds nothing, then one that steps through the matches;
+# Enter ends the first, an ESC right before Ctrl-F would decode as Alt-F
+{ printf '\006'; printf 'zzz_not_there'; printf '\r'; printf '\006'; printf 'var1999'; repeat '\033[B' 50; printf '\r'; } > "$DIR/search.keys"
+{ repeat '\033[F\033[B' 1000; repeat '\033[H\033[B' 1000; } > "$DIR/long-lines.keys"
+
+run() {
+    echo "== $1 ($2)"
+    "$KILO" --headless "$SIZE" --script "$DIR/$1.keys" "$DIR/$2"
+    echo
+}
+
+run scroll-lines large.c
+run scroll-pages large.c
+run typing large.c
+run search large.c
+run long-lines long.log
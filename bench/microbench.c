@@ -0,0 +1,278 @@
+// Microbenchmarks for kilo's row, highlight, draw and search functions.
+//
+// Builds the editor core without its main and times each function over
+// synthetic corpora. Results go to stdout (or --json FILE) as JSON; with
+// --baseline FILE any result slower than baseline * --tolerance fails the
+// run, so a saved baseline catches regressions.
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#define BENCH_REPEATS 5
+#define BENCH_MAX_RESULTS 64
+
+struct benchResult
+{
+    char name[64];
+    double ns_per_op;
+};
+
+struct benchResult results[BENCH_MAX_RESULTS];
+int nresults = 0;
+
+long benchNow()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void benchAdd(const char *op, const char *corpus, long best_ns, long ops)
+{
+    struct benchResult *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s/%s", op, corpus);
+    r->ns_per_op = (double)best_ns / ops;
+    fprintf(stderr, "%-28s %12.1f ns/op\n", r->name, r->ns_per_op);
+}
+
+void benchClear()
+{
+    while (E.numrows)
+        editorDelRow(E.numrows - 1);
+}
+
+// fill the buffer with one of the synthetic corpora
+void benchLoad(const char *corpus)
+{
+    char line[4096];
+    int n = 0, j;
+    benchClear();
+
+    for (j = 0; j < 20000; j++)
+    {
+        if (!strcmp(corpus, "tabs"))
+        {
+            n = snprintf(line, sizeof(line), "\t\tx%d =\ty;\t\t// c\t%d\t\tz", j, j);
+        }
+        else if (!strcmp(corpus, "long"))
+        {
+            if (j == 2000)
+                break;
+            for (n = 0; n < 2000; n++)
+                line[n] = "abcd efgh, 123 \"ij\" "[n % 20];
+        }
+        else if (!strcmp(corpus, "utf8"))
+        {
+            // multibyte and wide characters, so rows take the decoding path
+            n = snprintf(line, sizeof(line), "\tx%d = \"na\xc3\xafve caf\xc3\xa9\";\t// "
+                         "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e %d \xe2\x86\x92 z", j, j);
+        }
+        else if (!strcmp(corpus, "comments"))
+        {
+            // comment openers pile up and only close every 100 rows,
+            // so edits near the top cascade far down
+            if (j % 100 == 99)
+                n = snprintf(line, sizeof(line), "end %d */ int x = %d;", j, j);
+            else
+                n = snprintf(line, sizeof(line), "/* /* /* %d /* nested %d", j, j);
+        }
+        else
+        {
+            n = snprintf(line, sizeof(line), "if (x%d) return; while (y) { int z = %d; char c; "
+                         "} else switch (v) { case 3: break; } unsigned long q; void f(double d);", j, j);
+        }
+        editorInsertRow(E.numrows, line, n);
+    }
+}
+
+void benchCorpus(const char *corpus)
+{
+    long best, t0;
+    int rep, j;
+    benchLoad(corpus);
+
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        t0 = benchNow();
+        for (j = 0; j < E.numrows; j++)
+            editorUpdateRow(&E.row[j]);
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("editorUpdateRow", corpus, best, E.numrows);
+
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        t0 = benchNow();
+        for (j = 0; j < E.numrows; j++)
+            editorUpdateSyntax(&E.row[j]);
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("editorUpdateSyntax", corpus, best, E.numrows);
+
+    volatile int sink = 0;
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        t0 = benchNow();
+        for (j = 0; j < E.numrows; j++)
+            sink += editorRowCxToRx(&E.row[j], E.row[j].size);
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("editorRowCxToRx", corpus, best, E.numrows);
+
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        t0 = benchNow();
+        for (j = 0; j < E.numrows; j++)
+            sink += editorRowRxToCx(&E.row[j], E.row[j].rsize);
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("editorRowRxToCx", corpus, best, E.numrows);
+
+    // a full repaint of every screenful
+    struct abuf ab = ABUF_INIT;
+    int frames = 0;
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        frames = 0;
+        t0 = benchNow();
+        for (E.rowoff = 0; E.rowoff < E.numrows; E.rowoff += E.screenrows)
+        {
+            editorScrollFrame(&ab);
+            editorInvalidateFrame();
+            editorDrawRows(&ab);
+            ab.len = 0;
+            frames++;
+        }
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    abFree(&ab);
+    E.rowoff = 0;
+    benchAdd("editorDrawRows", corpus, best, frames);
+
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        int len;
+        t0 = benchNow();
+        free(editorRowsToString(&len));
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("editorRowsToString", corpus, best, 1);
+
+    // a miss, so the workers scan the whole buffer
+    best = -1;
+    for (rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        t0 = benchNow();
+        editorSearchPost("zzz_not_there", -1, 1);
+        while (editorSearchBusy())
+            usleep(10);
+        t0 = benchNow() - t0;
+        if (best == -1 || t0 < best)
+            best = t0;
+    }
+    benchAdd("search", corpus, best, 1);
+    (void)sink;
+}
+
+// read results written by a previous run and fail on regressions
+int benchCheck(const char *path, double tolerance)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        return 1;
+    }
+
+    char line[256], name[64];
+    double ns;
+    int failed = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns_per_op\": %lf}", name, &ns) != 2)
+            continue;
+        for (int i = 0; i < nresults; i++)
+        {
+            if (strcmp(results[i].name, name) || results[i].ns_per_op <= ns * tolerance)
+                continue;
+            fprintf(stderr, "REGRESSION %s: %.1f ns/op, baseline %.1f ns/op\n",
+                    name, results[i].ns_per_op, ns);
+            failed = 1;
+        }
+    }
+    fclose(fp);
+    return failed;
+}
+
+void benchWriteJson(FILE *fp)
+{
+    fprintf(fp, "{\n  \"results\": [\n");
+    for (int i = 0; i < nresults; i++)
+        fprintf(fp, "    {\"name\": \"%s\", \"ns_per_op\": %.1f}%s\n", results[i].name,
+                results[i].ns_per_op, i + 1 < nresults ? "," : "");
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *json = NULL, *baseline = NULL;
+    double tolerance = 1.25;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            json = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Usage: microbench [--json FILE] [--baseline FILE] [--tolerance X]\n");
+            return 1;
+        }
+    }
+
+    E.headless = 1;
+    E.screenrows = 48;
+    E.screencols = 160;
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    initEditor();
+    E.filename = "bench.c";
+    editorSelectSyntaxHighlight();
+
+    benchCorpus("tabs");
+    benchCorpus("long");
+    benchCorpus("comments");
+    benchCorpus("keywords");
+    benchCorpus("utf8");
+
+    FILE *fp = json ? fopen(json, "w") : stdout;
+    if (!fp)
+    {
+        perror(json);
+        return 1;
+    }
+    benchWriteJson(fp);
+    if (json)
+        fclose(fp);
+
+    return baseline ? benchCheck(baseline, tolerance) : 0;
+}
@@ -6,17 +6,30 @@
 #define _GNU_SOURCE
 
 #include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <regex.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /** Defines * */
 #define KILO_VERSION "0.0.1"
@@ -24,8 +37,64 @@
 #define ABUF_INIT {NULL, 0}
 #define KILO_TABSTOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_SEARCH_MAX_THREADS 8
+#define KILO_SEARCH_SLICE_MIN 2048 // don't split off a worker for fewer rows
+#define KILO_SEARCH_CHUNK 4096 // rows scanned between progress reports
+#define KILO_REPLACE_PROGRESS_ROWS 65536 // rows between progress repaints
+#define KILO_FRAME_MS 16 // max time input may hold back a repaint
+#define KILO_HIST_BUCKETS 496 // 8 sub-buckets for each power of two of a 64 bit value
+#define KILO_TRACE_RING 65536 // spans kept per thread, oldest are overwritten
+#define KILO_COLD_BLOCK_ROWS 256 // rows compressed together
+#define KILO_EVICT_TARGET 80 // evict down to this percentage of the memory budget
+#define KILO_EVICT_MARGIN 5 // percent of the budget to grow by before evicting again
+#define KILO_JOURNAL_FLUSH_MS 1000 // group commit window for the swap file
+#define KILO_JOURNAL_MAX_PENDING (64 * 1024) // flush early past this many bytes
+#define KILO_JOURNAL_MAGIC "KILOJNL1"
+#define KILO_UNDO_CAP_MB 64 // default memory cap of the undo history
+#define KILO_LOAD_FIRST_CHUNK (64 * 1024) // small, so the first screen shows quickly
+#define KILO_LOAD_CHUNK (1024 * 1024)
+#define KILO_LOAD_QUEUE 8 // chunks read ahead of the rows
+#define KILO_LOAD_SLICE_MS 8 // time spent making rows between looks at the keyboard
+#define KILO_LOAD_BATCH 256 // rows made between looks at the clock
+#define KILO_INDEX_MIN_SIZE (16LL * 1024 * 1024) // smaller files load fast enough without a sidecar
+#define KILO_INDEX_BLOCK 256 // rows per comment state checkpoint
+#define KILO_INDEX_SAMPLE 4096 // bytes hashed at the start, middle and end of the file
+#define KILO_INDEX_MAGIC "KILOIDX1"
+#define KILO_BRACKET_BLOCK 64 // rows per leaf of the bracket tree
+#define KILO_GREP_PROBE 8192 // a nul byte this close to the start makes a file binary
+#define KILO_GREP_LINE_MAX 512 // bytes of a matching line kept in the results
+#define KILO_MACRO_POLL 256 // macro runs between looks at the keyboard
+#define KILO_HASH_MUL 0x100000001b3ULL // odd, powers of it weigh row hashes by position
+#define KILO_FOLLOW_READ (64 * 1024) // bytes read per go when the followed file grows
 
 /** Data **/
+// LZ compressed chars of a run of cold rows, shared by those rows
+struct coldBlock
+{
+    int refs; // rows still pointing here
+    int ulen;
+    int clen;
+    char data[];
+};
+
+// the last cold block decompressed, so neighbouring rows don't repeat the work
+struct coldCache
+{
+    struct coldBlock *blk;
+    char *data;
+    int cap;
+};
+
+// brackets outside strings and comments on a stretch of rows, opening
+// ones counting +1 and closing ones -1: the total and the lowest running
+// total. the highest total of a suffix is sum - minpre, so these two say
+// whether a bracket's partner is in the stretch without looking inside
+struct bracketSum
+{
+    int sum;
+    int minpre; // <= 0, or 1 while the row was never highlighted
+};
+
 typedef struct erow {
     int idx;
     char *chars;
@@ -34,6 +103,16 @@ typedef struct erow {
     int rsize;
     unsigned char *hl;
     int hl_open_comment;
+    int modified; // contents differ from what was read from disk
+    long long orig_off; // where the row starts in the file on disk, -1 if new
+    int orig_len; // bytes the row takes on disk, line terminator included
+    unsigned last_used; // E.tick when render/hl were last needed
+    struct coldBlock *cold; // set while chars is NULL because the row is compressed
+    int cold_off; // where the row's chars start in the decompressed block
+    int ascii; // no bytes above 127, so each byte of render is one column
+    int vlines; // screen lines the row takes when soft wrapping
+    uint64_t hash; // of chars, see editorRowRehash
+    struct bracketSum br; // kept by editorBracketRow
 } erow;
 struct editorSyntax
 {
@@ -46,8 +125,395 @@ struct editorSyntax
     int flags;
 };
 
+// state shared between the ui and the search worker pool
+// everything below lock is protected by it
+struct editorSearch
+{
+    pthread_t threads[KILO_SEARCH_MAX_THREADS];
+    int nthreads;
+    int wakefd[2]; // workers poke this pipe so the input loop can repaint
+    unsigned generation; // bumped to cancel a scan, read atomically by workers
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a new scan was posted
+    pthread_cond_t done; // the last worker finished its slice
+    unsigned jobgen; // generation of the posted scan
+    int pending; // workers still scanning the posted scan
+    int nslices;
+    char *query;
+    int qlen;
+    int origin; // row the scan is relative to (-1 = from the top)
+    int direction;
+    int numrows;
+    long matches;
+    int best_row; // nearest match in the search direction so far
+    int best_off;
+    int best_dist;
+
+    // ui side, only touched by the main thread
+    int active;
+    int last_match;
+    int shown_row;
+    int shown_off;
+    int saved_hl_line;
+    char *saved_hl;
+};
+
+// a search of every file under the current directory. the walk and the
+// scans share one worker pool; results are path:line:text lines in out,
+// which the ui streams into the buffer
+struct editorGrep
+{
+    pthread_t threads[KILO_SEARCH_MAX_THREADS];
+    int nthreads;
+    int wakefd[2];
+    unsigned generation; // bumped to cancel a walk, read atomically by workers
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; // paths were queued
+    pthread_cond_t done; // the queue ran dry and every worker is idle
+    char **todo; // files and directories still to look at
+    int ntodo;
+    int todocap;
+    int busy; // workers holding a path
+    char *pattern;
+    int plen;
+    int regex;
+    regex_t re[KILO_SEARCH_MAX_THREADS]; // one per worker, glibc serializes regexec on a shared one
+    char *out;
+    long outlen;
+    long outcap;
+    long files; // files scanned
+    long matches;
+
+    // ui side
+    int buffer; // the one showing the results, -1 if none
+    long shown; // bytes of out in that buffer
+};
+
+// append-only log of edits, replayed after a crash
+struct editorJournal
+{
+    int fd;
+    char *path;
+    off_t file_size; // the file on disk the journal applies to
+    time_t file_mtime;
+    char *pending; // records not yet written to disk
+    int pending_len;
+    int pending_cap;
+    struct timespec pending_since;
+    int replaying;
+};
+
+// one primitive edit in the undo history; its bytes live in the stack's arena
+struct undoRec
+{
+    unsigned char op;
+    int row;
+    int at; // column, or the row count of U_ROWS
+    int len;
+    long off; // of the bytes in the arena
+    unsigned seq; // the key that made it, records of one key undo together
+    unsigned last; // the last key that extended it
+    int cx, cy; // the cursor before the edit
+};
+
+struct undoStack
+{
+    struct undoRec *rec;
+    int n;
+    int cap;
+    char *arena;
+    long used;
+    long size;
+};
+
+struct editorUndo
+{
+    struct undoStack undo, redo;
+    unsigned seq; // bumped for every key, except inside a paste
+    int paste; // between the brackets of a bracketed paste
+    int applying; // undoing or redoing, don't record
+    int loading; // reading the file in, nothing to undo
+    int open; // the U_ROWS record the current key is still adding rows to, -1 if none
+    long long cap; // bytes of history kept, oldest records are dropped past it
+};
+
+// a piece of the file read by the loader thread
+struct loadChunk
+{
+    struct loadChunk *next;
+    int len;
+    char data[];
+};
+
+// a file streaming in: a thread reads it in chunks and the ui turns them
+// into rows between keys, so the first screen shows before the file is in
+struct editorLoad
+{
+    int active;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t space; // the reader waits for the queue to drain
+    pthread_cond_t more; // editorLoadFinish waits for chunks
+    struct loadChunk *head, *tail;
+    int queued;
+    struct loadChunk *cur; // being turned into rows, from pos on
+    int pos;
+    int eof;
+    int wakefd[2];
+    long long size;
+    long long off; // where the next row starts in the file
+    char *carry; // a line cut by the end of a chunk
+    int carry_len;
+    int carry_cap;
+    long long span;
+    int stop; // the buffer was closed, the reader quits
+};
+
+// hashes of every row, summed up, against the same for the file on disk
+// so whether the buffer is still what was read can be told without
+// looking at the text
+struct editorHash
+{
+    uint64_t sum; // of every row's hash, kept up to date by the row ops
+    // the file as loaded or last saved
+    uint64_t disk_sum;
+    uint64_t disk_poly; // sum of hash * KILO_HASH_MUL^row, which sees the order too
+    uint64_t disk_pow; // KILO_HASH_MUL^disk_rows
+    uint64_t disk_last_pow; // the weight of the last row
+    int disk_rows;
+    int disk_known; // 0 once we lost track of what the file holds
+    time_t checked; // when editorDiskCheck last looked at the file
+    off_t seen_size; // the change to the file editorDiskDiff last reported
+    time_t seen_mtime;
+};
+
+// the sidecar index, see editorIndexOpen
+struct indexHeader
+{
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    uint64_t sample; // editorIndexSample of the file
+    uint32_t rows;
+    uint32_t block;
+    // then uint64_t off[rows + 1] and unsigned char open[blocks]
+};
+
+// a big file's row offsets and per-block comment state, kept in a hidden
+// file next to it, so opening it again can skip highlighting every row
+struct editorIndex
+{
+    void *map; // the sidecar, while it is being used to load the file
+    size_t maplen;
+    const uint64_t *off; // where each row starts, then the file size
+    const unsigned char *open; // hl_open_comment of the last row of each block
+    int rows;
+    int lazy; // leave rows' comment state unknown (-1) until they are drawn
+    uint64_t sample;
+    pthread_t writer;
+    int writing; // writer has to be joined
+};
+
+// --follow: bytes written to the end of the file become rows as they
+// land, like tail -f. the file is reloaded if it is truncated or replaced
+struct editorFollow
+{
+    int on;
+    int ifd; // inotify, -1 while the file is (re)loading
+    int fd; // the file we loaded, kept open so a rotated log is read to its end
+    dev_t dev;
+    ino_t ino;
+    int partial; // the last row has no newline yet and may grow
+    int pin; // go to the end once the file is in
+};
+
+// what the terminal currently shows, so frames only repaint what changed
+struct editorFrame
+{
+    uint64_t *hash; // hash of each screen line as last painted, 0 = unknown
+    int rows;
+    int rowoff;
+    int coloff;
+
+    // scheduling and statistics
+    struct timespec last; // when the last frame was written
+    long frames;
+    long skipped; // refreshes dropped because more input was queued
+    long keys;
+    long frame_keys; // keys handled since the last frame
+    long long bytes;
+    int last_keys;
+    int last_bytes;
+    long last_ns; // time to build and write the last frame
+    long last_build_ns;
+    long last_write_ns;
+};
+
+// what the editor's memory is spent on, see editorMemReport
+enum memCategory
+{
+    MEM_CHARS = 0,
+    MEM_RENDER,
+    MEM_HL,
+    MEM_ROWS, // the E.row array itself
+    MEM_OUTPUT, // frame buffers and screen line hashes
+    MEM_SEARCH,
+    MEM_JOURNAL,
+    MEM_SCRATCH, // short-lived buffers for save and replace
+    MEM_COLD, // compressed chars of cold rows
+    MEM_UNDO, // undo and redo history
+    MEM_CATEGORIES
+};
+
+enum latencyStage
+{
+    LAT_READ = 0, // decoding a key once input is there
+    LAT_PROCESS,
+    LAT_DRAW,
+    LAT_WRITE,
+    LAT_KEY_TO_PAINT, // first byte of a key to its frame hitting the terminal
+    LAT_STAGES
+};
+
+// log-linear histogram of nanoseconds, within 12.5% of the real value
+struct latencyHist
+{
+    long count;
+    long max;
+    unsigned counts[KILO_HIST_BUCKETS];
+};
+
+struct editorLatency
+{
+    struct latencyHist hist[LAT_STAGES];
+    long long key_start; // when the oldest unpainted key arrived, 0 if none
+    long long key_ready; // when the last key was decoded
+    char *dump_path;
+};
+
+// a complete span ("ph":"X") in the chrome trace event format
+struct traceEvent
+{
+    const char *name;
+    long long start; // ns
+    long long dur;
+    long arg; // -1 if the span has no argument
+};
+
+// each thread writes only to its own ring, so recording takes no lock
+struct traceRing
+{
+    struct traceEvent ev[KILO_TRACE_RING];
+    unsigned long head;
+    int tid;
+    struct traceRing *next;
+};
+
+// soft wrap layout: a Fenwick tree over erow.vlines, so going between
+// screen lines and rows is O(log n) and an edit updates one entry
+struct editorWrap
+{
+    int on;
+    int *tree; // 1-based
+    int size; // rows in the tree
+    int cols; // width the rows were laid out for
+    int dirty; // rows were inserted or deleted, rebuild before use
+    int relayout; // every row's vlines is stale too, not just the tree
+    int voff; // screen line at the top of the screen
+    int cur_y, cur_x; // where the cursor is on screen
+};
+
+// rows start + 1 to end are hidden behind row start
+struct fold
+{
+    int start;
+    int end;
+};
+
+// closed folds: nested or apart, never overlapping, sorted by start.
+// the outermost ones (top) are what hides rows, and hid[k] counts the
+// rows hidden by top[0..k), so rows and screen lines map to each other
+// with a binary search over them
+struct editorFolds
+{
+    struct fold *all;
+    int n;
+    struct fold *top;
+    int ntop;
+    int *hid; // ntop + 1 entries
+};
+
+// bracket sums of blocks of rows in a segment tree, so finding a
+// partner skips whole blocks. built when first needed with
+// KILO_BRACKET_BLOCK rows a block; rows that come or go grow or shrink
+// their block, and row edits only update their leaf
+struct editorBrackets
+{
+    struct bracketSum *tree; // 1 is the root, leaves start at leaves
+    int *count; // rows under each node
+    int leaves; // a power of two
+    int size; // rows the tree is over
+    int dirty;
+    int row[2], off[2]; // the bracket at the cursor and its partner, row -1 if none
+};
+
+// keys recorded with Ctrl-K, replayed by editorReadKey
+struct editorMacro
+{
+    int *keys;
+    int n;
+    int cap;
+    int recording;
+    int replaying; // no frames are drawn and highlighting waits for the end
+    int pos; // next key to replay
+    int overrun; // a key was wanted past the last one, e.g. by a prompt
+};
+
+// per key timings collected when replaying a script headless
+struct editorBench
+{
+    long *process;
+    long *render;
+    long *write;
+    int n;
+    int cap;
+};
+
+// the part of E that belongs to the file being edited. the other open
+// files keep theirs here while out of sight, see editorBufferUse
+struct editorBuffer
+{
+    int cx, cy, rx;
+    int numrows;
+    int rowoff;
+    int coloff;
+    int dirty;
+    erow *row;
+    char *filename;
+    int disk_valid;
+    off_t disk_size;
+    time_t disk_mtime;
+    struct editorSyntax *syntax;
+    struct editorJournal journal;
+    struct editorUndo undo;
+    struct editorLoad *load;
+    struct editorFollow follow;
+    struct editorIndex index;
+    struct editorHash hash;
+    struct editorWrap wrap;
+    struct editorFolds folds;
+    struct editorBrackets brackets;
+    struct coldCache coldcache;
+};
+
 struct editorConfig {
     struct termios original_termios;
+    int infd; // the terminal, or the key script when headless
+    int outfd;
+    int headless;
     int screenrows;
     int screencols;
     int cx, cy;
@@ -58,9 +524,41 @@ struct editorConfig {
     int dirty;
     erow *row;
     char *filename;
+    int disk_valid; // rows' orig_off/orig_len describe the file on disk
+    off_t disk_size;
+    time_t disk_mtime;
     char statusmsg[80];
+    char statusextra[32]; // appended to statusmsg, e.g. search match count
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct editorSearch search;
+    struct editorGrep grep;
+    struct editorJournal journal;
+    struct editorUndo undo;
+    struct editorLoad *load; // allocated, its reader thread holds on to it
+    struct editorFollow follow;
+    struct editorIndex index;
+    struct editorHash hash;
+    struct editorFrame frame;
+    struct editorWrap wrap;
+    struct editorFolds folds;
+    struct editorBrackets brackets;
+    struct editorMacro macro;
+    struct editorBench bench;
+    struct editorLatency latency;
+    char *trace_path; // record spans and write them here at exit
+    long long mem[MEM_CATEGORIES]; // bytes allocated, see memRealloc
+    long long mem_budget; // evict render/hl of cold rows past this, 0 = no limit
+    unsigned tick; // bumped every frame, for the row LRU
+    int evict_hand; // the row editorEnforceBudget looks at next
+    unsigned evict_lap; // E.tick when the hand last started over
+    long long evict_settled; // memTotal after the last eviction
+    struct coldCache coldcache;
+    pthread_rwlock_t rowlock; // search workers read rows while the ui (de)compresses them
+    struct editorBuffer *bufs; // every open file, bufs[curbuf] is stale while E has it
+    int nbufs;
+    int curbuf;
+    int shownbuf; // the one on screen, which curbuf isn't while a hidden one loads
 };
 
 struct editorConfig E;
@@ -104,6 +602,8 @@ enum editorKey {
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
 };
 
 enum editorHighlight
@@ -118,12 +618,280 @@ enum editorHighlight
     HL_KEYWORD2,
 };
 
+enum editorJournalOp
+{
+    J_INSERT_CHAR = 1,
+    J_DEL_CHAR,
+    J_INSERT_ROW,
+    J_DEL_ROW,
+    J_APPEND,
+    J_SET_ROW,
+    J_TRUNCATE,
+};
+// primitive edits as kept in the undo history
+enum undoOp
+{
+    U_INSERT = 1, // bytes typed into a row
+    U_DELETE, // bytes deleted from a row
+    U_ROWS, // a run of rows inserted, their contents are only kept for redo
+    U_DEL_ROW,
+    U_APPEND,
+    U_TRUNCATE, // keeps the bytes cut off
+    U_SET, // keeps the old and the new contents
+};
+
+
 
 /** prototypes **/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorSearchPoll(void);
+int editorLoadPoll(void);
+void editorLoadFinish(void);
+int editorFollowPoll(void);
+void editorFollowStart(int partial);
+void editorFollowStop(void);
+int editorGrepPoll(void);
+void editorEnforceBudget(void);
+void editorBufferUse(int k);
+void editorBufferEvictHidden(long long target);
+void editorSearchCancel(void);
+void editorSearchRestoreHighlight(void);
+void editorMoveToRow(int y);
+uint64_t editorHashBytes(const char *s, int len);
+int editorJournalTimeout(void);
+void editorJournalFlush(void);
+void editorJournalRecord(int op, int row, int at, const char *s, int len);
+void editorUndoRecord(int op, int row, int at, const char *s, int len, const char *s2, int len2);
+void editorUpdateRender(erow *row);
+void editorRowEvict(erow *row);
+void editorRowEnsureRender(erow *row);
+void editorWrapUpdateRow(erow *row);
+void editorInvalidateFrame(void);
+int editorFoldHidden(int row);
+void editorFoldShift(int at, int n);
+int editorFoldOnScreen(int row);
+void editorBracketRow(erow *row);
+void editorBracketShift(int at, int n);
+void editorMacroRecord(void);
+void editorMacroPrompt(void);
+
+
+/** Latency **/
+// cheap enough to leave on: one vDSO clock read and one increment per sample
+long long editorNowNs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int latencyBucket(unsigned long long v)
+{
+    if (v < 8)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - 2) * 8 + ((v >> (e - 3)) & 7);
+}
+
+// the smallest value that lands in bucket i
+unsigned long long latencyBucketValue(int i)
+{
+    if (i < 8)
+        return i;
+    int e = i / 8 + 2;
+    return (unsigned long long)(8 + i % 8) << (e - 3);
+}
+
+void latencyRecord(int stage, long long ns)
+{
+    struct latencyHist *h = &E.latency.hist[stage];
+    if (ns < 0)
+        ns = 0;
+    h->counts[latencyBucket(ns)]++;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+long latencyPercentile(struct latencyHist *h, double q)
+{
+    long want = h->count * q, seen = 0;
+    for (int i = 0; i < KILO_HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen > want)
+            return latencyBucketValue(i);
+    }
+    return h->max;
+}
+
+const char *latencyStageName[LAT_STAGES] = {"read", "process", "draw", "write", "key->paint"};
+
+void editorShowLatency(int stage)
+{
+    struct latencyHist *h = &E.latency.hist[stage];
+    editorSetStatusMessage("%s: %ld samples, p50 %ld us, p99 %ld us, max %ld us",
+                           latencyStageName[stage], h->count, latencyPercentile(h, 0.5) / 1000,
+                           latencyPercentile(h, 0.99) / 1000, h->max / 1000);
+}
+
+// write every histogram out, called at exit when --latency FILE was given
+void editorLatencyDump()
+{
+    FILE *fp = fopen(E.latency.dump_path, "w");
+    if (!fp)
+        return;
+
+    for (int s = 0; s < LAT_STAGES; s++)
+    {
+        struct latencyHist *h = &E.latency.hist[s];
+        fprintf(fp, "# %s count=%ld p50=%ld p90=%ld p99=%ld p999=%ld max=%ld (ns)\n",
+                latencyStageName[s], h->count, latencyPercentile(h, 0.5), latencyPercentile(h, 0.9),
+                latencyPercentile(h, 0.99), latencyPercentile(h, 0.999), h->max);
+        for (int i = 0; i < KILO_HIST_BUCKETS; i++)
+            if (h->counts[i])
+                fprintf(fp, "%s %llu %u\n", latencyStageName[s], latencyBucketValue(i), h->counts[i]);
+    }
+    fclose(fp);
+}
+
+/** Memory accounting **/
+// allocation wrappers that keep E.mem up to date, using the sizes the
+// allocator really handed out so rounding and slack are accounted for
+void *memRealloc(int cat, void *p, size_t size)
+{
+    long long old = p ? malloc_usable_size(p) : 0;
+    p = realloc(p, size);
+    E.mem[cat] += (long long)(p ? malloc_usable_size(p) : 0) - old;
+    return p;
+}
+
+void *memMalloc(int cat, size_t size)
+{
+    return memRealloc(cat, NULL, size);
+}
+
+void memFree(int cat, void *p)
+{
+    if (!p)
+        return;
+    E.mem[cat] -= malloc_usable_size(p);
+    free(p);
+}
+
+const char *memCategoryName[MEM_CATEGORIES] = {
+    "chars", "render", "hl", "rows", "output", "search", "journal", "scratch", "cold", "undo"
+};
+
+long long memTotal()
+{
+    long long total = 0;
+    for (int i = 0; i < MEM_CATEGORIES; i++)
+        total += E.mem[i];
+    return total;
+}
+
+// resident set size from /proc, -1 if unavailable
+long long memResident()
+{
+    long long pages = -1;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%*s %lld", &pages) != 1)
+            pages = -1;
+        fclose(fp);
+    }
+    return pages == -1 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+void editorMemReport(FILE *fp)
+{
+    long long total = memTotal();
+    long long rss = memResident();
+    for (int i = 0; i < MEM_CATEGORIES; i++)
+        fprintf(fp, "%-10s %14lld\n", memCategoryName[i], E.mem[i]);
+    fprintf(fp, "%-10s %14lld\n", "total", total);
+    if (rss != -1)
+        fprintf(fp, "%-10s %14lld (%lld not accounted for)\n", "resident", rss, rss - total);
+}
+
+void editorShowMemory()
+{
+    editorSetStatusMessage("mem %.1fM: chars %.1fM render %.1fM hl %.1fM rows %.1fM other %.1fM",
+                           memTotal() / 1048576.0, E.mem[MEM_CHARS] / 1048576.0,
+                           E.mem[MEM_RENDER] / 1048576.0, E.mem[MEM_HL] / 1048576.0,
+                           E.mem[MEM_ROWS] / 1048576.0,
+                           (memTotal() - E.mem[MEM_CHARS] - E.mem[MEM_RENDER] - E.mem[MEM_HL] -
+                            E.mem[MEM_ROWS]) / 1048576.0);
+}
+
+/** Tracing **/
+struct traceRing *trace_rings = NULL; // every thread's ring, for the final dump
+__thread struct traceRing *trace_ring = NULL;
+int trace_tids = 0;
+
+// start a span, returns 0 when tracing is off
+long long traceBegin()
+{
+    return E.trace_path ? editorNowNs() : 0;
+}
+
+void traceEnd(const char *name, long long start, long arg)
+{
+    if (!start)
+        return;
+
+    struct traceRing *r = trace_ring;
+    if (!r)
+    {
+        r = calloc(1, sizeof(*r));
+        r->tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+        r->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            ;
+        trace_ring = r;
+    }
+
+    struct traceEvent *ev = &r->ev[r->head % KILO_TRACE_RING];
+    ev->name = name;
+    ev->start = start;
+    ev->dur = editorNowNs() - start;
+    ev->arg = arg;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// write the recorded spans as chrome trace event json (chrome://tracing, perfetto)
+void traceDump()
+{
+    FILE *fp = fopen(E.trace_path, "w");
+    if (!fp)
+        return;
 
+    fprintf(fp, "{\"traceEvents\": [\n");
+    const char *sep = "";
+    for (struct traceRing *r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long i = head > KILO_TRACE_RING ? head - KILO_TRACE_RING : 0;
+        for (; i < head; i++)
+        {
+            struct traceEvent *ev = &r->ev[i % KILO_TRACE_RING];
+            fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f", sep, ev->name, r->tid,
+                    ev->start / 1000.0, ev->dur / 1000.0);
+            if (ev->arg != -1)
+                fprintf(fp, ", \"args\": {\"n\": %ld}", ev->arg);
+            fprintf(fp, "}");
+            sep = ",\n";
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
 
 /** Terminal **/
 void die(const char *e)
@@ -136,6 +904,7 @@ void die(const char *e)
 
 void disableRawMode(void)
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_termios) == -1)
         die("tcsetattr");
 }
@@ -159,6 +928,9 @@ void enableRawMode(void)
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
 
+    // have pastes bracketed, so one undoes as a single step
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -215,13 +987,23 @@ int is_separator(int c)
 }
 
 
-void editorUpdateSyntax(erow *row)
+// highlight a single row
+// returns 1 if the row's open comment state changed, so the next row is stale
+int editorHighlightRow(erow *row)
 {
-    row->hl = realloc(row->hl, row->rsize);
+    // the render may have been evicted, see editorRowEnsureRender
+    if (!row->render)
+	editorUpdateRender(row);
+    row->last_used = E.tick;
+
+    row->hl = memRealloc(MEM_HL, row->hl, row->rsize);
     memset(row->hl, HL_NORMAL, row->rsize); // set everything in hl to HL_NORMAL
 
     if (E.syntax == NULL)
-	return;
+    {
+        editorBracketRow(row);
+	return 0;
+    }
 
     char **keywords = E.syntax->keywords;
 
@@ -233,6 +1015,17 @@ void editorUpdateSyntax(erow *row)
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mcs) : 0;
     
+    // rows loaded from the index don't know their comment state until
+    // the rows before them are highlighted, back to the last checkpoint
+    if (row->idx > 0 && E.row[row->idx - 1].hl_open_comment < 0)
+    {
+        int j = row->idx - 1;
+        while (j > 0 && E.row[j - 1].hl_open_comment < 0)
+            j--;
+        for (; j < row->idx; j++)
+            editorHighlightRow(&E.row[j]);
+    }
+
     int prev_sep = 1;
     int in_string = 0;
     int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
@@ -240,7 +1033,7 @@ void editorUpdateSyntax(erow *row)
     int i = 0;
     while (i < row->rsize)
     {
-	char c = row->render[i];
+	unsigned char c = row->render[i];
 	unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
 
 	if (scs_len && !in_string && !in_comment) 
@@ -364,10 +1157,33 @@ void editorUpdateSyntax(erow *row)
     // this makes the comment status of the current row linger to the nex
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
+    editorBracketRow(row);
 
-    if (changed && row->idx + 1 < E.numrows)
-	editorUpdateSyntax(&E.row[row->idx + 1]);
-    
+    return changed;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+    // a macro replay highlights once at the end, see editorMacroHighlight
+    if (E.macro.replaying)
+    {
+        memFree(MEM_HL, row->hl);
+        row->hl = NULL;
+        row->hl_open_comment = -1;
+        row->br.minpre = 1;
+        return;
+    }
+
+    // an opened or closed multiline comment changes the rows below,
+    // so keep going until the comment state stops changing
+    long long span = traceBegin();
+    int at = row->idx;
+    while (editorHighlightRow(&E.row[at]) && at + 1 < E.numrows)
+	at++;
+
+    // single rows are too many to trace, only cascades are interesting
+    if (at > row->idx)
+	traceEnd("highlight cascade", span, at - row->idx + 1);
 }
 
 int editorSyntaxToColor(int hl)
@@ -414,11 +1230,13 @@ void editorSelectSyntaxHighlight()
 	    {
 		E.syntax = s;
 
+		long long span = traceBegin();
 		int filerow;
 		for (filerow = 0; filerow < E.numrows; filerow++)
 		{
 		    editorUpdateSyntax(&E.row[filerow]);
 		}
+		traceEnd("highlight", span, E.numrows);
 		return;
 	    }
 	    i++;
@@ -428,8 +1246,106 @@ void editorSelectSyntaxHighlight()
     
 }
 
-// wait for a keypress and return it
-int editorReadKey()
+// block until there is input on stdin, repainting whenever
+// a background job (e.g. a search scan) reports progress and
+// flushing the journal when its group commit window closes
+void editorWaitForInput()
+{
+    while (1)
+    {
+        // buffers out of sight load while the keyboard is idle
+        struct pollfd fds[5 + E.nbufs];
+        int hidden[E.nbufs], nfds = 5;
+        fds[0].fd = E.infd;
+        fds[0].events = POLLIN;
+        fds[1].fd = E.search.wakefd[0];
+        fds[1].events = POLLIN;
+        fds[2].fd = E.load->active ? E.load->wakefd[0] : -1;
+        fds[2].events = POLLIN;
+        fds[3].fd = E.follow.ifd;
+        fds[3].events = POLLIN;
+        // filling a results buffer out of sight swaps it into E, which
+        // can't happen under a search; the wakeup stays in the pipe
+        // until the search is over
+        int grepwait = E.grep.buffer != E.curbuf && E.search.active;
+        fds[4].fd = E.grep.nthreads && !grepwait ? E.grep.wakefd[0] : -1;
+        fds[4].events = POLLIN;
+        for (int k = 0; k < E.nbufs && !E.search.active; k++)
+        {
+            if (k == E.curbuf || !E.bufs[k].load->active)
+                continue;
+            hidden[nfds - 5] = k;
+            fds[nfds].fd = E.bufs[k].load->wakefd[0];
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        int ready = poll(fds, nfds, editorJournalTimeout());
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        if (ready == 0)
+        {
+            editorJournalFlush();
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(E.search.wakefd[0], drain, sizeof(drain)) > 0)
+                ;
+            if (editorSearchPoll())
+                editorRefreshScreen();
+        }
+
+        if (fds[2].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(E.load->wakefd[0], drain, sizeof(drain)) > 0)
+                ;
+            if (editorLoadPoll())
+                editorRefreshScreen();
+        }
+
+        if (fds[3].revents & POLLIN)
+        {
+            if (editorFollowPoll())
+                editorRefreshScreen();
+        }
+
+        if (fds[4].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(E.grep.wakefd[0], drain, sizeof(drain)) > 0)
+                ;
+            if (editorGrepPoll())
+                editorRefreshScreen();
+        }
+
+        for (int j = 5; j < nfds; j++)
+        {
+            if (!(fds[j].revents & POLLIN))
+                continue;
+            char drain[64];
+            while (read(fds[j].fd, drain, sizeof(drain)) > 0)
+                ;
+            int shown = E.curbuf;
+            editorBufferUse(hidden[j - 5]);
+            editorLoadPoll();
+            editorBufferUse(shown);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+            return;
+    }
+}
+
+// decode the keypress waiting on the input
+int editorDecodeKey()
 {
     int nread;
     char c;
@@ -440,25 +1356,40 @@ int editorReadKey()
     // checks. One alternative would be to use a int initialized to zero
     // but we opted to use a char and it gets extended with zeros
     // when it is returned
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    while ((nread = read(E.infd, &c, 1)) != 1)
     {
         if(nread == -1 && errno != EAGAIN)
             die("read");
+        if (nread == 0 && E.headless)
+            exit(0); // end of the key script
     }
 
     if (c == '\x1b')
     {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if (read(E.infd, &seq[0], 1) != 1)
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (read(E.infd, &seq[1], 1) != 1)
             return '\x1b';
         if (seq[0] == '[')
         {
             if (seq[1] > '0' && seq[1] <= '9')
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if (read(E.infd, &seq[2], 1) != 1)
+                    return '\x1b';
+
+                // bracketed paste, ESC [ 200 ~ and ESC [ 201 ~
+                if (seq[1] == '2' && seq[2] == '0')
+                {
+                    char end[2];
+                    if (read(E.infd, end, 2) != 2 || end[1] != '~')
+                        return '\x1b';
+                    if (end[0] == '0')
+                        return PASTE_START;
+                    if (end[0] == '1')
+                        return PASTE_END;
                     return '\x1b';
+                }
                 
                 if (seq[2] == '~')
                 {
@@ -517,76 +1448,788 @@ int editorReadKey()
     }
     else
     {
-        return c;
+        return (unsigned char)c;
     }
 
 }
 
-/** Row ops*/
-int editorRowCxToRx(erow *row, int cx)
+// wait for a keypress and return it
+int editorReadKey()
 {
-    int i, rx = 0;
-    for (i = 0; i < cx; i++)
+    struct editorMacro *m = &E.macro;
+    if (m->replaying)
     {
-        if (row->chars[i] == '\t')
-            rx += (KILO_TABSTOP - 1) - (rx % KILO_TABSTOP);
-        rx++;
+        if (m->pos < m->n)
+            return m->keys[m->pos++];
+        // whatever still waits for a key gets escape, and the replay stops
+        m->overrun = 1;
+        return '\x1b';
     }
 
-    return rx;
-}
+    editorWaitForInput();
 
-int editorRowRxToCx(erow *row, int rx)
-{
-    int cur_rx = 0;
-    int cx = 0;
-    for (cx = 0; cx < row->size; cx++)
-    {
-	if (row->chars[cx] == '\t')
-	    cur_rx += (KILO_TABSTOP - 1) - (cur_rx % KILO_TABSTOP);
-	cur_rx++;
+    long long start = editorNowNs();
+    int key = editorDecodeKey();
+    E.latency.key_ready = editorNowNs();
+    latencyRecord(LAT_READ, E.latency.key_ready - start);
 
-	if (cur_rx > rx)
-	    return cx;
+    // a frame can carry several keys, it's late for the oldest one
+    if (!E.latency.key_start)
+        E.latency.key_start = start;
+    if (m->recording)
+    {
+        if (m->n == m->cap)
+        {
+            m->cap = m->cap ? m->cap * 2 : 64;
+            m->keys = memRealloc(MEM_SCRATCH, m->keys, sizeof(int) * m->cap);
+        }
+        m->keys[m->n++] = key;
+    }
+    return key;
+}
+
+/** Cold rows **/
+// a small LZ77 block codec in the style of LZ4: each sequence is a token
+// (4 bits literal length, 4 bits match length - 4, 15 = more length bytes
+// follow), the literals, then a 2 byte offset back into the output.
+// the last sequence has literals only
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+int lzBound(int len)
+{
+    return len + len / 255 + 16;
+}
+
+char *lzPutLength(char *op, int len)
+{
+    while (len >= 255)
+    {
+        *op++ = (char)255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+char *lzPutSequence(char *op, const char *lit, int litlen, int offset, int mlen)
+{
+    unsigned char *token = (unsigned char *)op++;
+    *token = (litlen >= 15 ? 15 : litlen) << 4;
+    if (litlen >= 15)
+        op = lzPutLength(op, litlen - 15);
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if (mlen)
+    {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        mlen -= LZ_MIN_MATCH;
+        *token |= mlen >= 15 ? 15 : mlen;
+        if (mlen >= 15)
+            op = lzPutLength(op, mlen - 15);
+    }
+    return op;
+}
+
+// compress len bytes of src into dst, which must hold lzBound(len) bytes
+int lzCompress(const char *src, int len, char *dst)
+{
+    int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+    char *op = dst;
+    int ip = 0, anchor = 0;
+
+    while (ip + LZ_MIN_MATCH <= len)
+    {
+        uint32_t v;
+        memcpy(&v, src + ip, 4);
+        int h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref >= 0 && ip - ref <= 65535 && !memcmp(src + ref, src + ip, LZ_MIN_MATCH))
+        {
+            int mlen = LZ_MIN_MATCH;
+            while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+                mlen++;
+            op = lzPutSequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+            ip += mlen;
+            anchor = ip;
+        }
+        else
+        {
+            ip++;
+        }
+    }
+    op = lzPutSequence(op, src + anchor, len - anchor, 0, 0);
+    return op - dst;
+}
+
+// returns the decompressed length, or -1 if src is corrupt
+int lzDecompress(const char *src, int slen, char *dst, int dcap)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + slen;
+    int op = 0;
+
+    while (ip < end)
+    {
+        int token = *ip++;
+        int litlen = token >> 4;
+        if (litlen == 15)
+        {
+            while (ip < end && *ip == 255)
+                litlen += *ip++;
+            if (ip < end)
+                litlen += *ip++;
+        }
+        if (litlen > end - ip || op + litlen > dcap)
+            return -1;
+        memcpy(dst + op, ip, litlen);
+        ip += litlen;
+        op += litlen;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15)
+        {
+            while (ip < end && *ip == 255)
+                mlen += *ip++;
+            if (ip < end)
+                mlen += *ip++;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > dcap)
+            return -1;
+        // byte by byte, matches may overlap what they produce
+        for (int i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+// a row's chars, decompressing its block through cache if it is cold
+// the pointer stays valid until the block is thawed or another block is peeked
+const char *coldPeek(erow *row, struct coldCache *cache)
+{
+    if (row->chars)
+        return row->chars;
+
+    struct coldBlock *blk = row->cold;
+    if (cache->blk != blk)
+    {
+        if (cache->cap < blk->ulen)
+        {
+            cache->cap = blk->ulen;
+            cache->data = realloc(cache->data, cache->cap);
+        }
+        lzDecompress(blk->data, blk->clen, cache->data, blk->ulen);
+        cache->blk = blk;
+    }
+    return cache->data + row->cold_off;
+}
+
+const char *editorRowPeek(erow *row)
+{
+    return coldPeek(row, &E.coldcache);
+}
+
+void coldRelease(struct coldBlock *blk)
+{
+    if (--blk->refs > 0)
+        return;
+    if (E.coldcache.blk == blk)
+        E.coldcache.blk = NULL;
+    memFree(MEM_COLD, blk);
+}
+
+// drop a cold row's reference to its block, for rows being deleted or replaced
+void editorRowDropCold(erow *row)
+{
+    if (!row->cold)
+        return;
+    pthread_rwlock_wrlock(&E.rowlock);
+    coldRelease(row->cold);
+    row->cold = NULL;
+    pthread_rwlock_unlock(&E.rowlock);
+}
+
+// give a cold row (and its neighbours from the same block) their chars back
+void editorRowEnsureChars(erow *row)
+{
+    if (row->chars)
+        return;
+
+    struct coldBlock *blk = row->cold;
+    editorRowPeek(row);
+    const char *data = E.coldcache.data;
+
+    int from = row->idx, to = row->idx;
+    while (from > 0 && E.row[from - 1].cold == blk)
+        from--;
+    while (to + 1 < E.numrows && E.row[to + 1].cold == blk)
+        to++;
+
+    pthread_rwlock_wrlock(&E.rowlock);
+    for (int j = from; j <= to; j++)
+    {
+        erow *r = &E.row[j];
+        r->chars = memMalloc(MEM_CHARS, r->size + 1);
+        memcpy(r->chars, data + r->cold_off, r->size);
+        r->chars[r->size] = '\0';
+        r->cold = NULL;
+        coldRelease(blk);
+    }
+    pthread_rwlock_unlock(&E.rowlock);
+}
+
+// compress the chars of rows [from, to) into one block
+void editorColdCompress(int from, int to)
+{
+    int ulen = 0, j;
+    for (j = from; j < to; j++)
+        ulen += E.row[j].size;
+
+    char *buf = memMalloc(MEM_SCRATCH, ulen + 1);
+    char *out = memMalloc(MEM_SCRATCH, lzBound(ulen));
+    int off = 0;
+    for (j = from; j < to; j++)
+    {
+        memcpy(buf + off, E.row[j].chars, E.row[j].size);
+        off += E.row[j].size;
+    }
+    int clen = lzCompress(buf, ulen, out);
+
+    struct coldBlock *blk = memMalloc(MEM_COLD, sizeof(struct coldBlock) + clen);
+    blk->refs = to - from;
+    blk->ulen = ulen;
+    blk->clen = clen;
+    memcpy(blk->data, out, clen);
+    memFree(MEM_SCRATCH, buf);
+    memFree(MEM_SCRATCH, out);
+
+    pthread_rwlock_wrlock(&E.rowlock);
+    off = 0;
+    for (j = from; j < to; j++)
+    {
+        erow *r = &E.row[j];
+        editorRowEvict(r);
+        memFree(MEM_CHARS, r->chars);
+        r->chars = NULL;
+        r->cold = blk;
+        r->cold_off = off;
+        off += r->size;
+    }
+    pthread_rwlock_unlock(&E.rowlock);
+}
+
+int editorCompareBlockAge(const void *a, const void *b)
+{
+    const unsigned *x = a, *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+// compress the least recently used blocks of rows until memory is back
+// under target; blocks on screen or under the cursor stay as they are
+void editorCompressCold(long long target)
+{
+    int nblocks = (E.numrows + KILO_COLD_BLOCK_ROWS - 1) / KILO_COLD_BLOCK_ROWS;
+    unsigned (*blocks)[2] = malloc(sizeof(*blocks) * (nblocks + 1));
+    int n = 0, b, j;
+
+    for (b = 0; b < nblocks; b++)
+    {
+        int from = b * KILO_COLD_BLOCK_ROWS;
+        int to = from + KILO_COLD_BLOCK_ROWS;
+        if (to > E.numrows)
+            to = E.numrows;
+        if (E.cy >= from && E.cy < to)
+            continue;
+
+        unsigned newest = 0;
+        for (j = from; j < to && E.row[j].chars && !editorFoldOnScreen(j); j++)
+            if (E.row[j].last_used > newest)
+                newest = E.row[j].last_used;
+        if (j < to)
+            continue; // on screen or partly cold already
+
+        blocks[n][0] = newest;
+        blocks[n][1] = b;
+        n++;
+    }
+    qsort(blocks, n, sizeof(*blocks), editorCompareBlockAge);
+
+    for (b = 0; b < n && memTotal() > target; b++)
+    {
+        int from = blocks[b][1] * KILO_COLD_BLOCK_ROWS;
+        int to = from + KILO_COLD_BLOCK_ROWS;
+        editorColdCompress(from, to > E.numrows ? E.numrows : to);
+    }
+    free(blocks);
+}
+
+/** UTF-8 **/
+// code points that take no column (combining marks) or two (east asian
+// wide and fullwidth forms, emoji), sorted for binary search
+static const int utf8_zero_width[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902}, {0x093a, 0x093a},
+    {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064},
+    {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+    {0xe0100, 0xe01ef}
+};
+
+static const int utf8_wide[][2] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+    {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+    {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19},
+    {0xfe30, 0xfe6f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4},
+    {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251}, {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e},
+    {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e},
+    {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2},
+    {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd}
+};
+
+int utf8InTable(int cp, const int (*table)[2], int n)
+{
+    int lo = 0, hi = n - 1;
+    if (cp < table[0][0] || cp > table[hi][1])
+        return 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cp > table[mid][1])
+            lo = mid + 1;
+        else if (cp < table[mid][0])
+            hi = mid - 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+// control characters (and bytes that aren't valid UTF-8, which decode
+// as -1) are drawn as one inverted symbol
+int utf8IsControl(int cp)
+{
+    return cp < 32 || (cp >= 127 && cp < 160);
+}
+
+// columns taken by code point cp on the terminal
+int utf8Width(int cp)
+{
+    if (cp < 0x300)
+        return 1;
+    if (utf8InTable(cp, utf8_zero_width, sizeof(utf8_zero_width) / sizeof(utf8_zero_width[0])))
+        return 0;
+    if (utf8InTable(cp, utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0])))
+        return 2;
+    return 1;
+}
+
+// decode the character at s (at most len bytes) into *cp and return its
+// length in bytes. a byte that doesn't start a valid sequence is a
+// character of its own, with *cp = -1
+int utf8Decode(const char *s, int len, int *cp)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    int n, min;
+    if (u[0] < 0x80)
+    {
+        *cp = u[0];
+        return 1;
+    }
+    else if (u[0] >= 0xc2 && u[0] <= 0xdf)
+    {
+        n = 2;
+        *cp = u[0] & 0x1f;
+        min = 0x80;
+    }
+    else if (u[0] >= 0xe0 && u[0] <= 0xef)
+    {
+        n = 3;
+        *cp = u[0] & 0x0f;
+        min = 0x800;
+    }
+    else if (u[0] >= 0xf0 && u[0] <= 0xf4)
+    {
+        n = 4;
+        *cp = u[0] & 0x07;
+        min = 0x10000;
+    }
+    else
+    {
+        *cp = -1;
+        return 1;
+    }
+
+    if (n > len)
+    {
+        *cp = -1;
+        return 1;
+    }
+    for (int i = 1; i < n; i++)
+    {
+        if ((u[i] & 0xc0) != 0x80)
+        {
+            *cp = -1;
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3f);
+    }
+    // overlong forms, surrogates and anything past U+10FFFF
+    if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+    {
+        *cp = -1;
+        return 1;
+    }
+    return n;
+}
+
+// whether len bytes at s are all ASCII, so that rows of plain text never
+// pay for decoding. checks 16 bytes at a time with SSE2, 8 without
+int utf8IsAscii(const char *s, int len)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v))
+            return 0;
+    }
+#endif
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, s + i, 8);
+        if (v & 0x8080808080808080ULL)
+            return 0;
+    }
+    for (; i < len; i++)
+        if (s[i] & 0x80)
+            return 0;
+    return 1;
+}
+
+/** Row ops*/
+// 64-bit hash of a row's text, eight bytes at a time
+uint64_t editorHashRow(const char *s, int len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+    uint64_t w;
+    int i;
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+// the row's chars changed (or it is new, with hash 0), keep its hash and
+// the buffer's sum of them in step
+void editorRowRehash(erow *row)
+{
+    E.hash.sum -= row->hash;
+    row->hash = editorHashRow(editorRowPeek(row), row->size);
+    E.hash.sum += row->hash;
+}
+
+// columns and bytes taken by the character at chars[cx], which starts
+// at column rx. ascii rows skip the decoding
+int editorRowCharAt(erow *row, const char *chars, int cx, int rx, int *bytes)
+{
+    if (chars[cx] == '\t')
+    {
+        *bytes = 1;
+        return KILO_TABSTOP - rx % KILO_TABSTOP;
+    }
+    if (row->ascii)
+    {
+        *bytes = 1;
+        return 1;
+    }
+    int cp;
+    *bytes = utf8Decode(&chars[cx], row->size - cx, &cp);
+    return utf8IsControl(cp) ? 1 : utf8Width(cp);
+}
+
+int editorRowCxToRx(erow *row, int cx)
+{
+    const char *chars = editorRowPeek(row);
+    int i = 0, rx = 0, n;
+    if (row->ascii)
+    {
+        for (; i < cx; i++)
+        {
+            if (chars[i] == '\t')
+                rx += (KILO_TABSTOP - 1) - (rx % KILO_TABSTOP);
+            rx++;
+        }
+        return rx;
+    }
+    while (i < cx)
+    {
+        rx += editorRowCharAt(row, chars, i, rx, &n);
+        i += n;
+    }
+
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+    const char *chars = editorRowPeek(row);
+    int cur_rx = 0;
+    int cx = 0, n;
+    if (row->ascii)
+    {
+        for (; cx < row->size; cx++)
+        {
+            if (chars[cx] == '\t')
+                cur_rx += (KILO_TABSTOP - 1) - (cur_rx % KILO_TABSTOP);
+            cur_rx++;
+
+            if (cur_rx > rx)
+                return cx;
+        }
+        return cx;
+    }
+    while (cx < row->size)
+    {
+	cur_rx += editorRowCharAt(row, chars, cx, cur_rx, &n);
+
+	if (cur_rx > rx)
+	    return cx;
+	cx += n;
     }
 
     return cx;
 }
 
-void editorUpdateRow(erow *row)
+// the offset in render (and hl) of the character at cx, which is the
+// same as its column unless the row has multibyte characters
+int editorRowCxToRenderOff(erow *row, int cx)
+{
+    if (row->ascii)
+        return editorRowCxToRx(row, cx);
+
+    const char *chars = editorRowPeek(row);
+    int i = 0, rx = 0, off = 0, n;
+    while (i < cx)
+    {
+        int w = editorRowCharAt(row, chars, i, rx, &n);
+        off += chars[i] == '\t' ? w : n;
+        rx += w;
+        i += n;
+    }
+    return off;
+}
+
+// where the cursor goes from cx moving one character right or left;
+// combining marks stay with the character before them
+int editorRowNextCx(erow *row, int cx)
+{
+    const char *chars = editorRowPeek(row);
+    int cp, n;
+    if (row->ascii)
+        return cx + 1;
+    cx += utf8Decode(&chars[cx], row->size - cx, &cp);
+    while (cx < row->size)
+    {
+        n = utf8Decode(&chars[cx], row->size - cx, &cp);
+        if (utf8IsControl(cp) || utf8Width(cp) != 0)
+            break;
+        cx += n;
+    }
+    return cx;
+}
+
+int editorRowPrevCx(erow *row, int cx)
+{
+    const char *chars = editorRowPeek(row);
+    int cp;
+    if (row->ascii)
+        return cx - 1;
+    while (cx > 0)
+    {
+        // back over continuation bytes to the start of the sequence
+        int j = cx - 1;
+        while (j > 0 && cx - j < 4 && (chars[j] & 0xc0) == 0x80)
+            j--;
+        if (j + utf8Decode(&chars[j], row->size - j, &cp) != cx)
+        {
+            j = cx - 1;
+            cp = -1;
+        }
+        cx = j;
+        if (utf8IsControl(cp) || utf8Width(cp) != 0)
+            break;
+    }
+    return cx;
+}
+
+void editorUpdateRender(erow *row)
 {
     // this function transforms the chars into what they look like
+    // (cold rows are rendered straight from their compressed block)
+    const char *chars = editorRowPeek(row);
+    row->ascii = utf8IsAscii(chars, row->size);
     int tabs = 0;
     // this pass is necessary to know the amount of memory to allocate
     int j;
     for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
+        if (chars[j] == '\t')
             tabs++;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TABSTOP - 1) + 1);
+    memFree(MEM_RENDER, row->render);
+    row->render = memMalloc(MEM_RENDER, row->size + tabs * (KILO_TABSTOP - 1) + 1);
 
     int idx = 0;
-    for (j = 0; j < row->size; j++)
+    if (row->ascii)
     {
-        if (row->chars[j] == '\t')
+        for (j = 0; j < row->size; j++)
         {
-            row->render[idx++] = ' ';
-
-            while (idx % KILO_TABSTOP != 0)
+            if (chars[j] == '\t')
+            {
                 row->render[idx++] = ' ';
+
+                while (idx % KILO_TABSTOP != 0)
+                    row->render[idx++] = ' ';
+            }
+            else
+            {
+                row->render[idx++] = chars[j];
+            }
         }
-        else
+    }
+    else
+    {
+        // tabs stop at columns, which aren't bytes here
+        int rx = 0, n;
+        for (j = 0; j < row->size; j += n)
         {
-            row->render[idx++] = row->chars[j];
+            int w = editorRowCharAt(row, chars, j, rx, &n);
+            if (chars[j] == '\t')
+            {
+                memset(&row->render[idx], ' ', w);
+                idx += w;
+            }
+            else
+            {
+                memcpy(&row->render[idx], &chars[j], n);
+                idx += n;
+            }
+            rx += w;
         }
     }
 
     row->render[idx] = '\0';
     row->rsize = idx;
+    editorWrapUpdateRow(row);
+}
+
+void editorUpdateRow(erow *row)
+{
+    editorUpdateRender(row);
     editorUpdateSyntax(row);
+}
+
+// rebuild render and hl if they were evicted
+// the row's incoming comment state is kept in the previous row's
+// hl_open_comment, so this never has to cascade
+void editorRowEnsureRender(erow *row)
+{
+    row->last_used = E.tick;
+    if (row->render && row->hl)
+        return;
+    editorUpdateRender(row);
+    editorHighlightRow(row);
+}
+
+void editorRowEvict(erow *row)
+{
+    memFree(MEM_RENDER, row->render);
+    memFree(MEM_HL, row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+}
+
+// over the memory budget, drop render and hl of the least recently used
+// rows until we are back under KILO_EVICT_TARGET percent of it
+// when the text alone is over, nothing more happens until memory has grown
+// by KILO_EVICT_MARGIN percent, not on every frame
+void editorEnforceBudget()
+{
+    long long total = memTotal();
+    if (total < E.evict_settled)
+        E.evict_settled = total;
+    if (!E.mem_budget || total <= E.mem_budget ||
+        total <= E.evict_settled + E.mem_budget / 100 * KILO_EVICT_MARGIN)
+        return;
+
+    long long target = E.mem_budget / 100 * KILO_EVICT_TARGET;
+    editorBufferEvictHidden(target);
+    if (memTotal() <= target)
+        return;
 
+    // what is left to take comes from the buffer on screen, which a
+    // hidden buffer loading in the background isn't
+    int cur = E.curbuf;
+    if (!E.search.active)
+        editorBufferUse(E.shownbuf);
+    // a clock: the hand goes round the rows from where it stopped, and a
+    // row used since it last started over gets another lap; after two laps
+    // only the rows on screen are left
+    for (int n = 0; n < 2 * E.numrows && memTotal() > target; n++)
+    {
+        if (E.evict_hand >= E.numrows)
+        {
+            E.evict_hand = 0;
+            E.evict_lap = E.tick;
+        }
+        int j = E.evict_hand++;
+        erow *row = &E.row[j];
+        if ((!row->render && !row->hl) || row->last_used >= E.evict_lap || editorFoldOnScreen(j))
+            continue;
+        editorRowEvict(row);
+    }
 
+    // still too much, compress the text of cold rows too
+    if (memTotal() > target)
+        editorCompressCold(target);
+    editorBufferUse(cur);
+    E.evict_settled = memTotal();
 }
 
 void editorInsertRow(int at, char *s, ssize_t len)
@@ -594,26 +2237,41 @@ void editorInsertRow(int at, char *s, ssize_t len)
     if (at < 0 || at > E.numrows)
         return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+    editorUndoRecord(U_ROWS, at, 0, NULL, 0, NULL, 0);
+    editorFoldShift(at, 1);
+    E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * (E.numrows + 1));
     memmove (&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
 
     int j;
     // increase the index of all other rows
-    for (j = at + 1; j < E.numrows; j++)
+    // (E.numrows is still the old count, so the last row is at E.numrows)
+    for (j = at + 1; j <= E.numrows; j++)
 	E.row[j].idx++;
 
 
     E.row[at].idx = at;
     E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
+    E.row[at].chars = memMalloc(MEM_CHARS, len + 1);
 
     memcpy(E.row[at].chars, s, len);
     E.row[at].chars[len] = '\0';
+    editorJournalRecord(J_INSERT_ROW, at, 0, s, len);
 
     E.row[at].render = NULL;
     E.row[at].hl = NULL;
     E.row[at].rsize = 0;
     E.row[at].hl_open_comment = 0;
+    E.row[at].modified = 1;
+    E.row[at].orig_off = -1;
+    E.row[at].orig_len = 0;
+    E.row[at].last_used = E.tick;
+    E.row[at].cold = NULL;
+    E.row[at].vlines = 0;
+    E.row[at].hash = 0;
+    E.row[at].br.sum = E.row[at].br.minpre = 0;
+    editorRowRehash(&E.row[at]);
+    E.wrap.dirty = 1;
+    editorBracketShift(at, 1);
     // copy stuff to render and size
     editorUpdateRow(&E.row[at]);
 
@@ -625,18 +2283,25 @@ void editorInsertRow(int at, char *s, ssize_t len)
 
 void editorFreeFow(erow *row)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    E.hash.sum -= row->hash;
+    editorRowDropCold(row);
+    memFree(MEM_RENDER, row->render);
+    memFree(MEM_CHARS, row->chars);
+    memFree(MEM_HL, row->hl);
 }
 
 void editorDelRow(int at)
 {
+    E.wrap.dirty = 1;
     if (at < 0 || at >= E.numrows)
         return;
     
+    editorJournalRecord(J_DEL_ROW, at, 0, NULL, 0);
+    editorUndoRecord(U_DEL_ROW, at, 0, editorRowPeek(&E.row[at]), E.row[at].size, NULL, 0);
+    editorFoldShift(at, -1);
     editorFreeFow(&E.row[at]);
     memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    editorBracketShift(at, -1);
 
     int j;
     // decrease the idx of subsequent rows after one is deleted
@@ -652,13 +2317,19 @@ void editorRowInsertChar(erow *row, int at, int c)
     // our char is an int (?)
     if (at < 0 || at > row->size)
         at = row->size;
+    editorRowEnsureChars(row);
+    char ch = c;
+    editorJournalRecord(J_INSERT_CHAR, row->idx, at, &ch, 1);
+    editorUndoRecord(U_INSERT, row->idx, at, &ch, 1, NULL, 0);
     // to allocate space for n chars we request n + 1
     // because of the null byte ('\0')
     // so to allocate space for n + 1, we request n + 2
-    row->chars = realloc(row->chars, row->size + 2);
+    row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->chars[at] = c;
     row->size++;
+    row->modified = 1;
+    editorRowRehash(row);
     editorUpdateRow(row); // recalculate the rendered stuff
 
     E.dirty++;
@@ -667,11 +2338,16 @@ void editorRowInsertChar(erow *row, int at, int c)
 
 void editorRowAppendString(erow *row, char *s, size_t len)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
+    editorJournalRecord(J_APPEND, row->idx, 0, s, len);
+    editorUndoRecord(U_APPEND, row->idx, row->size, s, len, NULL, 0);
+    editorRowEnsureChars(row);
+    row->chars = memRealloc(MEM_CHARS, row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
 
     row->size += len;
     row->chars[row->size] = '\0';
+    row->modified = 1;
+    editorRowRehash(row);
     editorUpdateRow(row);
 
     E.dirty++;
@@ -680,271 +2356,4057 @@ void editorRowAppendString(erow *row, char *s, size_t len)
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size)
     return;
+  editorJournalRecord(J_DEL_CHAR, row->idx, at, NULL, 0);
+  editorRowEnsureChars(row);
+  editorUndoRecord(U_DELETE, row->idx, at, &row->chars[at], 1, NULL, 0);
   // the null byte ('\0') gets copied here
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
+  row->modified = 1;
+  editorRowRehash(row);
   editorUpdateRow(row);
 
   E.dirty++;
 }
 
-/** Editor operations */
-void editorInsertChar(int c)
+// cut the row short at the given position
+void editorRowTruncate(erow *row, int at)
 {
-    if (E.cy == E.numrows)
-        editorInsertRow(E.numrows, "", 0);
-    
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    if (at < 0 || at >= row->size)
+        return;
+    editorJournalRecord(J_TRUNCATE, row->idx, at, NULL, 0);
+    editorRowEnsureChars(row);
+    editorUndoRecord(U_TRUNCATE, row->idx, at, &row->chars[at], row->size - at, NULL, 0);
+    row->size = at;
+    row->chars[at] = '\0';
+    row->modified = 1;
+    editorRowRehash(row);
+    editorUpdateRow(row);
 
+    E.dirty++;
 }
 
-void editorInsertNewLine()
+// swap in new contents for a row without re-rendering it
+// the caller is responsible for calling editorUpdateRender and highlighting
+void editorRowSetChars(erow *row, char *s, size_t len)
 {
-    if (E.cx == 0)
-        editorInsertRow(E.cy, "", 0); // current line becomes blank
+    editorJournalRecord(J_SET_ROW, row->idx, 0, s, len);
+    editorUndoRecord(U_SET, row->idx, row->size, editorRowPeek(row), row->size, s, len);
+    editorRowDropCold(row);
+    memFree(MEM_CHARS, row->chars);
+    row->chars = memMalloc(MEM_CHARS, len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->size = len;
+    row->modified = 1;
+    editorRowRehash(row);
+
+    E.dirty++;
+}
+
+// delete n rows at once, moving the rows after them only once
+// (undo takes back a whole paste this way)
+void editorDelRows(int at, int n)
+{
+    E.wrap.dirty = 1;
+    if (at < 0 || n <= 0 || at + n > E.numrows)
+        return;
+
+    int j;
+    for (j = at; j < at + n; j++)
+    {
+        editorJournalRecord(J_DEL_ROW, at, 0, NULL, 0);
+        editorFreeFow(&E.row[j]);
+    }
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    editorBracketShift(at, -n);
+    E.numrows -= n;
+    editorFoldShift(at, -n);
+    for (j = at; j < E.numrows; j++)
+        E.row[j].idx -= n;
+    E.dirty++;
+}
+
+// insert the newline separated rows in s at row at, moving the rows
+// after them only once
+void editorInsertRows(int at, const char *s, int len)
+{
+    if (at < 0 || at > E.numrows)
+        return;
+
+    int n = 1, j;
+    for (j = 0; j < len; j++)
+        if (s[j] == '\n')
+            n++;
+
+    E.wrap.dirty = 1;
+    editorFoldShift(at, n);
+    E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * (E.numrows + n));
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+    E.numrows += n;
+    for (j = at + n; j < E.numrows; j++)
+        E.row[j].idx += n;
+
+    const char *p = s, *end = s + len;
+    for (j = at; j < at + n; j++)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        int rlen = nl ? nl - p : end - p;
+        erow *row = &E.row[j];
+        memset(row, 0, sizeof(erow));
+        row->idx = j;
+        row->size = rlen;
+        row->chars = memMalloc(MEM_CHARS, rlen + 1);
+        memcpy(row->chars, p, rlen);
+        row->chars[rlen] = '\0';
+        row->modified = 1;
+        row->orig_off = -1;
+        row->last_used = E.tick;
+        editorRowRehash(row);
+        editorJournalRecord(J_INSERT_ROW, j, 0, p, rlen);
+        p += rlen + 1;
+    }
+    editorBracketShift(at, n);
+    for (j = at; j < at + n; j++)
+        editorUpdateRow(&E.row[j]);
+    E.dirty++;
+}
+
+/** Soft wrap **/
+// lay a row with multibyte characters out in lines of E.screencols
+// columns, breaking before a character that doesn't fit. walks up to
+// render offset until or to the start of line stop, whichever comes
+// first, and returns the line it got to. *off, *rx and *col get the
+// render offset, the column in the row and the column in the line there
+// the walk goes over chars, so laying out a row whose render was evicted
+// doesn't bring it back; a tab is a space per column, as in render
+int editorWrapWalk(erow *row, int until, int stop, int *off, int *rx, int *col)
+{
+    const char *chars = editorRowPeek(row);
+    int i = 0, j = 0, line = 0, c = 0, r = 0, tab = 0, n, cp, w;
+    for (;;)
+    {
+        n = w = 1; // the end of the row takes a column, for the cursor
+        if (!tab && i < row->size)
+        {
+            if (chars[i] == '\t')
+                tab = KILO_TABSTOP - r % KILO_TABSTOP;
+            else
+            {
+                n = utf8Decode(&chars[i], row->size - i, &cp);
+                w = utf8IsControl(cp) ? 1 : utf8Width(cp);
+            }
+        }
+        if (c + w > E.screencols && c > 0)
+        {
+            line++;
+            c = 0;
+        }
+        if (line >= stop || j >= until || (!tab && i >= row->size))
+            break;
+        c += w;
+        r += w;
+        j += n;
+        if (!tab)
+            i += n;
+        else if (--tab == 0)
+            i++;
+    }
+    if (off)
+        *off = j;
+    if (rx)
+        *rx = r;
+    if (col)
+        *col = c;
+    return line;
+}
+
+// screen lines row takes, ascii rows just divide
+int editorWrapLines(erow *row)
+{
+    if (editorFoldHidden(row->idx))
+        return 0;
+    if (row->ascii)
+        return row->rsize / E.screencols + 1;
+    return editorWrapWalk(row, row->rsize, INT_MAX, NULL, NULL, NULL) + 1;
+}
+
+// the line of row the cursor at cx is on, and its column there
+int editorWrapLineOf(erow *row, int cx, int *col)
+{
+    if (row->ascii)
+    {
+        int rx = editorRowCxToRx(row, cx);
+        *col = rx % E.screencols;
+        return rx / E.screencols;
+    }
+    return editorWrapWalk(row, editorRowCxToRenderOff(row, cx), INT_MAX, NULL, NULL, col);
+}
+
+// where line sub of row starts, as a column of the row and an offset in render
+int editorWrapLineStart(erow *row, int sub, int *off)
+{
+    int rx;
+    if (row->ascii)
+    {
+        rx = sub * E.screencols;
+        *off = rx < row->rsize ? rx : row->rsize;
+        return rx;
+    }
+    editorWrapWalk(row, INT_MAX, sub, off, &rx, NULL);
+    return rx;
+}
+
+void editorWrapAdd(int i, int delta)
+{
+    for (i++; i <= E.wrap.size; i += i & -i)
+        E.wrap.tree[i] += delta;
+}
+
+// screen lines taken by rows [0, n)
+int editorWrapPrefix(int n)
+{
+    int sum = 0;
+    for (; n > 0; n -= n & -n)
+        sum += E.wrap.tree[n];
+    return sum;
+}
+
+// the row screen line v is on, E.numrows past the end
+int editorWrapFind(int v)
+{
+    int pos = 0, step = 1;
+    while (step * 2 <= E.wrap.size)
+        step *= 2;
+    for (; step; step /= 2)
+    {
+        if (pos + step <= E.wrap.size && E.wrap.tree[pos + step] <= v)
+        {
+            pos += step;
+            v -= E.wrap.tree[pos];
+        }
+    }
+    return pos;
+}
+
+// rebuild the tree after rows came or went, from the lines each row
+// already knows it takes; only a resize, a change of folds or turning
+// wrapping on lays every row out again
+void editorWrapBuild()
+{
+    struct editorWrap *w = &E.wrap;
+    int i, j;
+    int relayout = w->relayout || w->cols != E.screencols;
+    w->tree = memRealloc(MEM_ROWS, w->tree, sizeof(int) * (E.numrows + 1));
+    w->size = E.numrows;
+    w->cols = E.screencols;
+    w->dirty = 0;
+    w->relayout = 0;
+    memset(w->tree, 0, sizeof(int) * (w->size + 1));
+    for (i = 1; i <= w->size; i++)
+    {
+        if (relayout)
+            E.row[i - 1].vlines = editorWrapLines(&E.row[i - 1]);
+        w->tree[i] += E.row[i - 1].vlines;
+        j = i + (i & -i);
+        if (j <= w->size)
+            w->tree[j] += w->tree[i];
+    }
+}
+
+void editorWrapSync()
+{
+    if (E.wrap.dirty || E.wrap.relayout || E.wrap.cols != E.screencols)
+        editorWrapBuild();
+}
+
+// an edit changed row, or made it: lay out just that row, and fix its
+// entry in the tree unless the tree is rebuilt anyway
+void editorWrapUpdateRow(erow *row)
+{
+    struct editorWrap *w = &E.wrap;
+    if (!w->on || w->relayout || w->cols != E.screencols)
+        return; // every row is laid out again before use
+    int lines = editorWrapLines(row);
+    if (!w->dirty && row->idx < w->size && lines != row->vlines)
+        editorWrapAdd(row->idx, lines - row->vlines);
+    row->vlines = lines;
+}
+
+// screen lines in the whole buffer
+int editorWrapTotal()
+{
+    return editorWrapPrefix(E.wrap.size);
+}
+
+// put the cursor on screen line v, col columns into it
+void editorWrapMoveTo(int v, int col)
+{
+    int total = editorWrapTotal();
+    if (v >= total)
+        v = total - 1;
+    if (v < 0)
+        v = 0;
+    E.cy = editorWrapFind(v);
+    E.cx = 0;
+    if (E.cy >= E.numrows)
+        return;
+
+    erow *row = &E.row[E.cy];
+    int sub = v - editorWrapPrefix(E.cy), off;
+    int rx = editorWrapLineStart(row, sub, &off) + col;
+    // stay on this line when the next one is shorter than col
+    if (sub + 1 < row->vlines)
+    {
+        int next = editorWrapLineStart(row, sub + 1, &off);
+        if (rx >= next)
+            rx = next - 1;
+    }
+    E.cx = editorRowRxToCx(row, rx);
+}
+
+// the screen line the cursor is on
+int editorWrapCursorLine(int *col)
+{
+    *col = 0;
+    if (E.cy >= E.numrows)
+        return editorWrapTotal();
+    return editorWrapPrefix(E.cy) + editorWrapLineOf(&E.row[E.cy], E.cx, col);
+}
+
+void editorWrapMoveCursor(int key)
+{
+    editorWrapSync();
+    int col, v = editorWrapCursorLine(&col);
+    if (key == ARROW_UP)
+        v--;
+    else if (key == ARROW_DOWN)
+        v++;
+    else if (key == PAGE_UP)
+        v = E.wrap.voff - E.screenrows;
+    else
+        v = E.wrap.voff + 2 * E.screenrows - 1;
+    if (v < 0)
+        return;
+    editorWrapMoveTo(v, col);
+}
+
+void editorToggleWrap()
+{
+    E.wrap.on = !E.wrap.on;
+    if (E.wrap.on)
+    {
+        E.wrap.relayout = 1;
+        editorWrapBuild();
+        E.wrap.voff = editorWrapPrefix(E.rowoff < E.numrows ? E.rowoff : E.numrows);
+    }
+    else
+    {
+        memFree(MEM_ROWS, E.wrap.tree);
+        E.wrap.tree = NULL;
+        E.wrap.size = 0;
+    }
+    E.coloff = 0;
+    editorInvalidateFrame();
+    editorSetStatusMessage("Soft wrap %s", E.wrap.on ? "on" : "off");
+}
+
+/** Folding **/
+// how many top level folds start before row
+int editorFoldTopBefore(int row)
+{
+    struct editorFolds *f = &E.folds;
+    int lo = 0, hi = f->ntop;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (f->top[mid].start < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int editorFoldHidden(int row)
+{
+    struct editorFolds *f = &E.folds;
+    if (!f->ntop)
+        return 0;
+    int k = editorFoldTopBefore(row);
+    return k > 0 && row <= f->top[k - 1].end;
+}
+
+// the screen line (without wrapping) row is on, a hidden row is on its fold's
+int editorFoldVisible(int row)
+{
+    struct editorFolds *f = &E.folds;
+    if (!f->ntop)
+        return row;
+    int k = editorFoldTopBefore(row);
+    if (k > 0 && row <= f->top[k - 1].end)
+        return f->top[k - 1].start - f->hid[k - 1];
+    return row - f->hid[k];
+}
+
+// the row on screen line v, the inverse of editorFoldVisible
+int editorFoldRowAt(int v)
+{
+    struct editorFolds *f = &E.folds;
+    if (!f->ntop)
+        return v;
+    // top folds whose first row is above line v
+    int lo = 0, hi = f->ntop;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (f->top[mid].start - f->hid[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return v + f->hid[lo];
+}
+
+int editorFoldNext(int row)
+{
+    return editorFoldRowAt(editorFoldVisible(row) + 1);
+}
+
+int editorFoldPrev(int row)
+{
+    return editorFoldRowAt(editorFoldVisible(row) - 1);
+}
+
+// whether row is drawn on the screen as it was last scrolled, taking
+// folded and wrapped rows into account
+int editorFoldOnScreen(int row)
+{
+    if (row < E.rowoff)
+        return 0;
+    if (E.wrap.on)
+    {
+        // every row takes a line at least, so the end is a bound when the
+        // tree is being rebuilt
+        if (E.wrap.dirty || E.wrap.size != E.numrows)
+            return row < E.rowoff + E.screenrows;
+        return row <= editorWrapFind(E.wrap.voff + E.screenrows - 1);
+    }
+    return !editorFoldHidden(row) && editorFoldVisible(row) < editorFoldVisible(E.rowoff) + E.screenrows;
+}
+
+// work out the top level folds after the set of folds changed
+void editorFoldIndex()
+{
+    struct editorFolds *f = &E.folds;
+    f->top = memRealloc(MEM_ROWS, f->top, sizeof(struct fold) * (f->n + 1));
+    f->hid = memRealloc(MEM_ROWS, f->hid, sizeof(int) * (f->n + 1));
+    f->ntop = 0;
+    f->hid[0] = 0;
+    for (int i = 0; i < f->n; i++)
+    {
+        if (f->ntop && f->all[i].start <= f->top[f->ntop - 1].end)
+            continue; // inside the previous top level fold
+        f->top[f->ntop] = f->all[i];
+        f->hid[f->ntop + 1] = f->hid[f->ntop] + f->all[i].end - f->all[i].start;
+        f->ntop++;
+    }
+    E.wrap.relayout = 1; // rows hidden or shown take no lines or some
+}
+
+// the closed fold starting at row, -1 if none
+int editorFoldFind(int row)
+{
+    struct editorFolds *f = &E.folds;
+    int lo = 0, hi = f->n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (f->all[mid].start < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < f->n && f->all[lo].start == row ? lo : -1;
+}
+
+void editorFoldRemove(int i)
+{
+    struct editorFolds *f = &E.folds;
+    memmove(&f->all[i], &f->all[i + 1], sizeof(struct fold) * (f->n - i - 1));
+    f->n--;
+}
+
+void editorFoldAdd(int start, int end)
+{
+    struct editorFolds *f = &E.folds;
+    int i = 0, j;
+    // a fold sticking out of the new one would overlap it
+    for (j = 0; j < f->n; j++)
+        if (!(f->all[j].start > start && f->all[j].start <= end && f->all[j].end > end))
+            f->all[i++] = f->all[j];
+    f->n = i;
+
+    f->all = memRealloc(MEM_ROWS, f->all, sizeof(struct fold) * (f->n + 1));
+    for (i = 0; i < f->n && f->all[i].start < start; i++)
+        ;
+    memmove(&f->all[i + 1], &f->all[i], sizeof(struct fold) * (f->n - i));
+    f->all[i].start = start;
+    f->all[i].end = end;
+    f->n++;
+}
+
+// open the folds row is hidden in
+void editorFoldReveal(int row)
+{
+    struct editorFolds *f = &E.folds;
+    int i = 0;
+    for (int j = 0; j < f->n; j++)
+        if (!(f->all[j].start < row && row <= f->all[j].end))
+            f->all[i++] = f->all[j];
+    f->n = i;
+    editorFoldIndex();
+}
+
+void editorFoldClear()
+{
+    E.folds.n = 0;
+    editorFoldIndex();
+}
+
+// rows were inserted (n > 0) or deleted (n < 0) at row at: move the folds
+// after them, grow or shrink the ones around them and drop the folds
+// whose first row went
+void editorFoldShift(int at, int n)
+{
+    struct editorFolds *f = &E.folds;
+    if (!f->n)
+        return;
+    int i = 0;
+    for (int j = 0; j < f->n; j++)
+    {
+        struct fold d = f->all[j];
+        if (n > 0)
+        {
+            if (d.start >= at)
+                d.start += n;
+            if (d.end >= at)
+                d.end += n;
+        }
+        else
+        {
+            int gone = at - n;
+            if (d.start >= at && d.start < gone)
+                continue;
+            if (d.start >= gone)
+                d.start += n;
+            if (d.end >= gone)
+                d.end += n;
+            else if (d.end >= at)
+                d.end = at - 1;
+            if (d.end <= d.start)
+                continue;
+        }
+        f->all[i++] = d;
+    }
+    f->n = i;
+    editorFoldIndex();
+}
+
+// how far a row is indented, -1 for a blank row
+int editorFoldIndent(erow *row)
+{
+    const char *c = editorRowPeek(row);
+    int j, col = 0;
+    for (j = 0; j < row->size && (c[j] == ' ' || c[j] == '\t'); j++)
+        col = c[j] == '\t' ? col + KILO_TABSTOP - col % KILO_TABSTOP : col + 1;
+    return j == row->size ? -1 : col;
+}
+
+// braces opened minus closed on a row, outside strings and // comments
+int editorFoldBraces(erow *row)
+{
+    const char *c = editorRowPeek(row);
+    int depth = 0, quote = 0;
+    for (int j = 0; j < row->size; j++)
+    {
+        if (quote)
+        {
+            if (c[j] == '\\')
+                j++;
+            else if (c[j] == quote)
+                quote = 0;
+        }
+        else if (c[j] == '"' || c[j] == '\'')
+            quote = c[j];
+        else if (c[j] == '/' && j + 1 < row->size && c[j + 1] == '/')
+            break;
+        else if (c[j] == '{')
+            depth++;
+        else if (c[j] == '}')
+            depth--;
+    }
+    return depth;
+}
+
+// the last row of the block row opens: up to the brace that closes the
+// one it leaves open, or else the rows indented deeper below it.
+// returns row if it opens nothing
+int editorFoldRange(int row)
+{
+    int depth = editorFoldBraces(&E.row[row]), j;
+    if (depth > 0)
+    {
+        for (j = row + 1; j < E.numrows; j++)
+        {
+            depth += editorFoldBraces(&E.row[j]);
+            if (depth <= 0)
+                return j;
+        }
+        return row;
+    }
+
+    int indent = editorFoldIndent(&E.row[row]), end = row;
+    if (indent < 0)
+        return row;
+    for (j = row + 1; j < E.numrows; j++)
+    {
+        int in = editorFoldIndent(&E.row[j]);
+        if (in < 0)
+            continue;
+        if (in <= indent)
+            break;
+        end = j;
+    }
+    return end;
+}
+
+// close the block the cursor row opens, or open it if it is closed
+void editorToggleFold()
+{
+    if (E.cy >= E.numrows)
+        return;
+    int i = editorFoldFind(E.cy);
+    if (i != -1)
+    {
+        editorFoldRemove(i);
+        editorFoldIndex();
+        return;
+    }
+    int end = editorFoldRange(E.cy);
+    if (end == E.cy)
+    {
+        editorSetStatusMessage("Nothing to fold here");
+        return;
+    }
+    editorFoldAdd(E.cy, end);
+    editorFoldIndex();
+}
+
+/** Brackets **/
+// +1 for an opening bracket, -1 for a closing one, 0 for anything else
+int editorBracketOf(char c)
+{
+    switch (c)
+    {
+    case '(': case '[': case '{':
+        return 1;
+    case ')': case ']': case '}':
+        return -1;
+    }
+    return 0;
+}
+
+// like editorBracketOf for render[j], but brackets in strings and
+// comments don't count
+int editorBracketAt(erow *row, int j)
+{
+    int h = row->hl[j];
+    if (h == HL_STRING || h == HL_COMMENT || h == HL_MLCOMMENT)
+        return 0;
+    return editorBracketOf(row->render[j]);
+}
+
+struct bracketSum editorBracketJoin(struct bracketSum a, struct bracketSum b)
+{
+    struct bracketSum s;
+    s.sum = a.sum + b.sum;
+    s.minpre = a.sum + b.minpre < a.minpre ? a.sum + b.minpre : a.minpre;
+    return s;
+}
+
+// the block row r is in, and in *first the row it starts at
+int editorBracketBlockOf(int r, int *first)
+{
+    struct editorBrackets *b = &E.brackets;
+    int node = 1;
+    *first = 0;
+    while (node < b->leaves)
+    {
+        node *= 2;
+        if (r - *first >= b->count[node])
+        {
+            *first += b->count[node];
+            node++;
+        }
+    }
+    return node - b->leaves;
+}
+
+// the row block starts at: the rows of the blocks before it
+int editorBracketStart(int block)
+{
+    struct editorBrackets *b = &E.brackets;
+    int i, first = 0;
+    for (i = b->leaves + block; i > 1; i /= 2)
+        if (i & 1)
+            first += b->count[i - 1];
+    return first;
+}
+
+// the sum of a block from its rows, and up the tree from its leaf
+void editorBracketUpdate(int block)
+{
+    struct editorBrackets *b = &E.brackets;
+    struct bracketSum s = {0, 0};
+    int i = b->leaves + block;
+    int r = editorBracketStart(block), end = r + b->count[i];
+    for (; r < end; r++)
+        s = editorBracketJoin(s, E.row[r].br);
+
+    b->tree[i] = s;
+    for (i /= 2; i >= 1; i /= 2)
+    {
+        b->tree[i] = editorBracketJoin(b->tree[2 * i], b->tree[2 * i + 1]);
+        b->count[i] = b->count[2 * i] + b->count[2 * i + 1];
+    }
+}
+
+// n rows came (n > 0) or went (n < 0) at row at, and the rows are in
+// place: only the blocks they are in change. the stored sums of the
+// other rows stay, so a block grown to twice its size is all it takes
+// to build the tree again
+void editorBracketShift(int at, int n)
+{
+    struct editorBrackets *b = &E.brackets;
+    int first, block, k;
+    if (!b->tree || b->dirty)
+        return;
+    if (b->size == 0)
+    {
+        b->dirty = 1;
+        return;
+    }
+
+    if (n > 0)
+    {
+        // the rows join the block of the row before them
+        block = editorBracketBlockOf(at > 0 ? at - 1 : 0, &first);
+        b->count[b->leaves + block] += n;
+        b->size += n;
+        if (b->count[b->leaves + block] > 2 * KILO_BRACKET_BLOCK)
+            b->dirty = 1;
+        else
+            editorBracketUpdate(block);
+        return;
+    }
+
+    // the rows went from one block after the other
+    for (n = -n; n > 0; n -= k)
+    {
+        block = editorBracketBlockOf(at, &first);
+        k = first + b->count[b->leaves + block] - at;
+        if (k > n)
+            k = n;
+        b->count[b->leaves + block] -= k;
+        b->size -= k;
+        editorBracketUpdate(block);
+    }
+}
+
+// called by editorHighlightRow, which has just made row's hl
+void editorBracketRow(erow *row)
+{
+    struct bracketSum s = {0, 0};
+    int j, first;
+    for (j = 0; j < row->rsize; j++)
+    {
+        s.sum += editorBracketAt(row, j);
+        if (s.sum < s.minpre)
+            s.minpre = s.sum;
+    }
+    if (s.sum == row->br.sum && s.minpre == row->br.minpre)
+        return;
+    row->br = s;
+
+    struct editorBrackets *b = &E.brackets;
+    if (b->tree && !b->dirty && row->idx < b->size)
+        editorBracketUpdate(editorBracketBlockOf(row->idx, &first));
+}
+
+// rows loaded from the index are highlighted here first, which for a
+// big file takes a while, but only the first time
+void editorBracketBuild()
+{
+    struct editorBrackets *b = &E.brackets;
+    long long span = traceBegin();
+    int r, k, blocks = (E.numrows + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK;
+
+    for (r = 0; r < E.numrows; r++)
+        if (E.row[r].br.minpre > 0)
+            editorHighlightRow(&E.row[r]);
+
+    b->leaves = 1;
+    while (b->leaves < blocks)
+        b->leaves *= 2;
+    b->tree = memRealloc(MEM_ROWS, b->tree, sizeof(struct bracketSum) * 2 * b->leaves);
+    b->count = memRealloc(MEM_ROWS, b->count, sizeof(int) * 2 * b->leaves);
+    memset(b->tree, 0, sizeof(struct bracketSum) * 2 * b->leaves);
+    memset(b->count, 0, sizeof(int) * 2 * b->leaves);
+    b->size = E.numrows;
+    b->dirty = 0;
+    for (k = 0; k < blocks; k++)
+    {
+        struct bracketSum s = {0, 0};
+        int end = (k + 1) * KILO_BRACKET_BLOCK < E.numrows ? (k + 1) * KILO_BRACKET_BLOCK : E.numrows;
+        for (r = k * KILO_BRACKET_BLOCK; r < end; r++)
+            s = editorBracketJoin(s, E.row[r].br);
+        b->tree[b->leaves + k] = s;
+        b->count[b->leaves + k] = end - k * KILO_BRACKET_BLOCK;
+    }
+    for (k = b->leaves - 1; k >= 1; k--)
+    {
+        b->tree[k] = editorBracketJoin(b->tree[2 * k], b->tree[2 * k + 1]);
+        b->count[k] = b->count[2 * k] + b->count[2 * k + 1];
+    }
+    traceEnd("bracket tree", span, E.numrows);
+}
+
+// the first block from block on where depth d comes down to 0, adding
+// the sums of the blocks before it to d; -1 if none
+int editorBracketDescendRight(int node, int lo, int hi, int block, int *d)
+{
+    struct bracketSum *t = E.brackets.tree;
+    if (hi < block)
+        return -1;
+    if (lo >= block && *d + t[node].minpre > 0)
+    {
+        *d += t[node].sum;
+        return -1;
+    }
+    if (lo == hi)
+        return lo;
+    int mid = (lo + hi) / 2;
+    int found = editorBracketDescendRight(2 * node, lo, mid, block, d);
+    if (found == -1)
+        found = editorBracketDescendRight(2 * node + 1, mid + 1, hi, block, d);
+    return found;
+}
+
+// the same going left, from block back, taking the sums off d
+int editorBracketDescendLeft(int node, int lo, int hi, int block, int *d)
+{
+    struct bracketSum *t = E.brackets.tree;
+    if (lo > block)
+        return -1;
+    if (hi <= block && t[node].sum - t[node].minpre < *d)
+    {
+        *d -= t[node].sum;
+        return -1;
+    }
+    if (lo == hi)
+        return lo;
+    int mid = (lo + hi) / 2;
+    int found = editorBracketDescendLeft(2 * node + 1, mid + 1, hi, block, d);
+    if (found == -1)
+        found = editorBracketDescendLeft(2 * node, lo, mid, block, d);
+    return found;
+}
+
+// the offset in row r, going from from the way of dir, where depth *d
+// comes down to 0; -1 with *d past the row if it doesn't
+int editorBracketScan(int r, int from, int dir, int *d)
+{
+    erow *row = &E.row[r];
+    editorRowEnsureRender(row);
+    int j;
+    for (j = from; j >= 0 && j < row->rsize; j += dir)
+    {
+        *d += dir * editorBracketAt(row, j);
+        if (*d == 0)
+            return j;
+    }
+    return -1;
+}
+
+// whether depth d (going the way of dir) gets to 0 within row r,
+// and if not, d past it
+int editorBracketInRow(int r, int dir, int *d)
+{
+    struct bracketSum *s = &E.row[r].br;
+    if (dir > 0 ? *d + s->minpre <= 0 : s->sum - s->minpre >= *d)
+        return 1;
+    *d += dir * s->sum;
+    return 0;
+}
+
+// the partner of the bracket at render offset off in row r: the rest of
+// the row, the rest of its block, then the tree finds the block with the
+// partner. returns the row, and the offset in *match, or -1
+int editorBracketFind(int r, int off, int *match)
+{
+    struct editorBrackets *b = &E.brackets;
+    int dir = editorBracketAt(&E.row[r], off);
+    int d = 0, j;
+
+    if ((j = editorBracketScan(r, off, dir, &d)) != -1)
+    {
+        *match = j;
+        return r;
+    }
+
+    if (b->dirty || !b->tree)
+        editorBracketBuild();
+
+    // rows to the edge of r's block
+    int first, block = editorBracketBlockOf(r, &first);
+    int k = r + dir, end = first + b->count[b->leaves + block];
+    while (k >= first && k < end)
+    {
+        if (editorBracketInRow(k, dir, &d))
+            goto found;
+        k += dir;
+    }
+    if (k < 0 || k >= E.numrows)
+        return -1;
+
+    block = editorBracketBlockOf(k, &first);
+    if (dir > 0)
+        block = editorBracketDescendRight(1, 0, b->leaves - 1, block, &d);
+    else
+        block = editorBracketDescendLeft(1, 0, b->leaves - 1, block, &d);
+    if (block == -1)
+        return -1;
+
+    // the block has it, find the row
+    k = editorBracketStart(block);
+    if (dir < 0)
+        k += b->count[b->leaves + block] - 1;
+    while (!editorBracketInRow(k, dir, &d))
+        k += dir;
+
+found:
+    editorRowEnsureRender(&E.row[k]);
+    j = editorBracketScan(k, dir > 0 ? 0 : E.row[k].rsize - 1, dir, &d);
+    if (j == -1)
+        return -1;
+    *match = j;
+    return k;
+}
+
+// the bracket under the cursor and its partner, for the frame to show.
+// brackets of different kinds don't pair
+void editorBracketMatch()
+{
+    struct editorBrackets *b = &E.brackets;
+    b->row[0] = b->row[1] = -1;
+    if (E.cy >= E.numrows)
+        return;
+    erow *row = &E.row[E.cy];
+    editorRowEnsureRender(row);
+    int off = editorRowCxToRenderOff(row, E.cx);
+    if (off >= row->rsize || !editorBracketAt(row, off))
+        return;
+
+    int match, r = editorBracketFind(E.cy, off, &match);
+    if (r == -1)
+        return;
+    const char *pairs = "()[]{}";
+    char c = row->render[off];
+    if (E.row[r].render[match] != pairs[(strchr(pairs, c) - pairs) ^ 1])
+        return;
+    b->row[0] = E.cy;
+    b->off[0] = off;
+    b->row[1] = r;
+    b->off[1] = match;
+}
+
+// move the cursor to the partner of the bracket under it
+void editorBracketJump()
+{
+    struct editorBrackets *b = &E.brackets;
+    editorBracketMatch();
+    if (b->row[1] == -1)
+    {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    erow *row = &E.row[b->row[1]];
+    int cx = 0;
+    while (cx < row->size && editorRowCxToRenderOff(row, cx) < b->off[1])
+        cx = editorRowNextCx(row, cx);
+    E.cy = b->row[1];
+    E.cx = cx;
+}
+
+/** Editor operations */
+void editorInsertChar(int c)
+{
+    // while loading, the line past the rows so far isn't the end of the
+    // file yet; a row added there would end up in the middle of it
+    if (E.cy >= E.numrows)
+        editorLoadFinish();
+    if (E.cy == E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+    
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+
+}
+
+void editorInsertNewLine()
+{
+    if (E.cy >= E.numrows)
+        editorLoadFinish(); // see editorInsertChar
+    if (E.cx == 0)
+        editorInsertRow(E.cy, "", 0); // current line becomes blank
+    else
+    {
+        erow *row = &E.row[E.cy];
+        editorRowEnsureChars(row);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+
+        // This reassignment is needed because editorInsertRow calls realloc
+        // on E.row, and that might move things, invalidating the previous address
+        // try removing this line and pressing enter on a really long line
+        row = &E.row[E.cy];
+
+        // don't need to re-render the new row (E.cy + 1)
+        // because editorInsertRow already does it
+        editorRowTruncate(row, E.cx);
+    }
+    E.cx = 0;
+    E.cy++;
+}
+
+void editorDelChar()
+{
+    if (E.cy == E.numrows)
+        return;
+    else if (E.cy == 0 && E.cx == 0)
+        return;
+    
+
+    
+    erow *row = &E.row[E.cy];
+    if (E.cx > 0) // if there's a character at the left of the cursor (cursor not at 0)
+    {
+        // all the bytes of it, and any combining marks after it
+        int prev = editorRowPrevCx(row, E.cx);
+        while (E.cx > prev)
+        {
+            editorRowDelChar(row, E.cx - 1);
+            E.cx--;
+        }
+    }
+    else
+    {
+        E.cx = E.row[E.cy - 1].size;
+        editorRowEnsureChars(&E.row[E.cy - 1]);
+        editorRowEnsureChars(row);
+        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+/** Journal **/
+// ops that carry a column and ops that carry a byte string
+#define J_HAS_AT(op) ((op) == J_INSERT_CHAR || (op) == J_DEL_CHAR || (op) == J_TRUNCATE)
+#define J_HAS_BYTES(op) ((op) == J_INSERT_CHAR || (op) == J_INSERT_ROW || \
+                         (op) == J_APPEND || (op) == J_SET_ROW)
+
+// hidden file next to filename, e.g. foo/bar.c -> foo/.bar.c.swp
+char *editorSiblingPath(const char *filename, const char *suffix)
+{
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    base = base ? base + 1 : filename;
+
+    int len = dirlen + 1 + strlen(base) + strlen(suffix);
+    char *path = malloc(len + 1);
+    snprintf(path, len + 1, "%.*s.%s%s", dirlen, filename, base, suffix);
+    return path;
+}
+
+void editorJournalPut(struct editorJournal *j, const char *s, int len)
+{
+    if (j->pending_len + len > j->pending_cap)
+    {
+        j->pending_cap = (j->pending_len + len) * 2;
+        j->pending = memRealloc(MEM_JOURNAL, j->pending, j->pending_cap);
+    }
+    memcpy(&j->pending[j->pending_len], s, len);
+    j->pending_len += len;
+}
+
+// LEB128, so small row and column numbers take a single byte
+void editorJournalPutVarint(struct editorJournal *j, unsigned long v)
+{
+    char buf[10];
+    int n = 0;
+    do
+    {
+        buf[n] = v & 0x7f;
+        v >>= 7;
+        if (v)
+            buf[n] |= 0x80;
+        n++;
+    } while (v);
+    editorJournalPut(j, buf, n);
+}
+
+// write out the pending records in one go (group commit)
+void editorJournalFlush()
+{
+    struct editorJournal *j = &E.journal;
+    if (j->fd == -1 || j->pending_len == 0)
+        return;
+
+    if (write(j->fd, j->pending, j->pending_len) == j->pending_len)
+        fdatasync(j->fd);
+    else
+        editorSetStatusMessage("Can't write swap file: %s", strerror(errno));
+    j->pending_len = 0;
+}
+
+// milliseconds until the pending records are due, -1 if nothing is pending
+int editorJournalTimeout()
+{
+    struct editorJournal *j = &E.journal;
+    if (j->fd == -1 || j->pending_len == 0)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - j->pending_since.tv_sec) * 1000 +
+                   (now.tv_nsec - j->pending_since.tv_nsec) / 1000000;
+    return elapsed >= KILO_JOURNAL_FLUSH_MS ? 0 : KILO_JOURNAL_FLUSH_MS - elapsed;
+}
+
+int editorJournalCreate()
+{
+    struct editorJournal *j = &E.journal;
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (j->fd == -1)
+        return -1;
+
+    editorJournalPut(j, KILO_JOURNAL_MAGIC, strlen(KILO_JOURNAL_MAGIC));
+    editorJournalPutVarint(j, j->file_size);
+    editorJournalPutVarint(j, j->file_mtime);
+    return 0;
+}
+
+void editorJournalRecord(int op, int row, int at, const char *s, int len)
+{
+    struct editorJournal *j = &E.journal;
+    if (j->replaying || !j->path)
+        return;
+
+    if (j->fd == -1 && editorJournalCreate() == -1)
+    {
+        // no swap file, we just lose crash protection
+        free(j->path);
+        j->path = NULL;
+        return;
+    }
+
+    if (j->pending_len == 0)
+        clock_gettime(CLOCK_MONOTONIC, &j->pending_since);
+
+    char c = op;
+    editorJournalPut(j, &c, 1);
+    editorJournalPutVarint(j, row);
+    if (J_HAS_AT(op))
+        editorJournalPutVarint(j, at);
+    if (J_HAS_BYTES(op))
+    {
+        editorJournalPutVarint(j, len);
+        editorJournalPut(j, s, len);
+    }
+
+    if (j->pending_len >= KILO_JOURNAL_MAX_PENDING)
+        editorJournalFlush();
+}
+
+int editorJournalGetVarint(const unsigned char **p, const unsigned char *end, unsigned long *v)
+{
+    int shift = 0;
+    *v = 0;
+    while (*p < end && shift < 64)
+    {
+        unsigned char b = *(*p)++;
+        *v |= (unsigned long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+        shift += 7;
+    }
+    return -1;
+}
+
+// apply the records in buf, stopping at the first torn or invalid one
+// returns the number of records applied
+long editorJournalReplay(const unsigned char *p, const unsigned char *end)
+{
+    long n = 0;
+    while (p < end)
+    {
+        int op = *p++;
+        unsigned long row, at = 0, len = 0;
+        if (editorJournalGetVarint(&p, end, &row) == -1)
+            break;
+        if (J_HAS_AT(op) && editorJournalGetVarint(&p, end, &at) == -1)
+            break;
+        if (J_HAS_BYTES(op) && (editorJournalGetVarint(&p, end, &len) == -1 ||
+                                len > (unsigned long)(end - p)))
+            break;
+
+        int valid = (op == J_INSERT_ROW) ? row <= (unsigned long)E.numrows
+                                         : row < (unsigned long)E.numrows;
+        if (!valid)
+            break;
+
+        erow *r = &E.row[row];
+        switch (op)
+        {
+            case J_INSERT_CHAR:
+                editorRowInsertChar(r, at, *p);
+                break;
+            case J_DEL_CHAR:
+                editorRowDelChar(r, at);
+                break;
+            case J_INSERT_ROW:
+                editorInsertRow(row, (char *)p, len);
+                break;
+            case J_DEL_ROW:
+                editorDelRow(row);
+                break;
+            case J_APPEND:
+                editorRowAppendString(r, (char *)p, len);
+                break;
+            case J_SET_ROW:
+                // hl has to follow render even when no syntax highlights
+                // the file afterwards, see editorJournalOpen
+                editorRowSetChars(r, (char *)p, len);
+                editorUpdateRow(r);
+                break;
+            case J_TRUNCATE:
+                editorRowTruncate(r, at);
+                break;
+            default:
+                return n;
+        }
+        p += len;
+        n++;
+    }
+    return n;
+}
+
+int editorAskYesNo(const char *question)
+{
+    while (1)
+    {
+        editorSetStatusMessage("%s (y/n)", question);
+        editorRefreshScreen();
+        int c = editorReadKey();
+        if (c == 'y' || c == 'Y')
+            return 1;
+        if (c == 'n' || c == 'N' || c == '\x1b')
+            return 0;
+    }
+}
+
+// look for a swap file left by a crashed session and offer to replay it
+void editorJournalOpen(const char *filename)
+{
+    struct editorJournal *j = &E.journal;
+    free(j->path);
+    j->path = editorSiblingPath(filename, ".swp");
+    j->fd = -1;
+    j->pending_len = 0;
+
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        return;
+    j->file_size = st.st_size;
+    j->file_mtime = st.st_mtime;
+
+    int fd = open(j->path, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    struct stat jst;
+    unsigned char *buf = NULL;
+    if (fstat(fd, &jst) == 0 && jst.st_size > 0)
+    {
+        buf = malloc(jst.st_size);
+        if (read(fd, buf, jst.st_size) != jst.st_size)
+        {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    close(fd);
+    if (!buf)
+        return;
+
+    int mlen = strlen(KILO_JOURNAL_MAGIC);
+    const unsigned char *p = buf + mlen;
+    const unsigned char *end = buf + jst.st_size;
+    unsigned long size, mtime;
+    if (jst.st_size < mlen || memcmp(buf, KILO_JOURNAL_MAGIC, mlen) != 0 ||
+        editorJournalGetVarint(&p, end, &size) == -1 ||
+        editorJournalGetVarint(&p, end, &mtime) == -1)
+    {
+        free(buf);
+        return;
+    }
+
+    if (p < end)
+    {
+        if (size != (unsigned long)st.st_size || mtime != (unsigned long)st.st_mtime)
+        {
+            editorSetStatusMessage("Ignoring %s: the file changed since it was written", j->path);
+        }
+        else if (editorAskYesNo("Found unsaved changes in a swap file. Recover them?"))
+        {
+            // highlight once at the end instead of after every record
+            E.syntax = NULL;
+            j->replaying = 1;
+            long n = editorJournalReplay(p, end);
+            j->replaying = 0;
+            editorSelectSyntaxHighlight();
+
+            // keep appending to the recovered journal
+            j->fd = open(j->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+            editorSetStatusMessage("Recovered %ld edits from %s", n, j->path);
+        }
+    }
+    free(buf);
+}
+
+// the edits are either saved or thrown away on purpose
+void editorJournalDiscard()
+{
+    editorJournalFlush();
+    if (E.journal.path)
+        unlink(E.journal.path);
+}
+
+// the file on disk is up to date again, start over with an empty journal
+void editorJournalReset()
+{
+    struct editorJournal *j = &E.journal;
+    if (j->fd != -1)
+        close(j->fd);
+    j->fd = -1;
+    j->pending_len = 0;
+
+    if (j->path)
+        unlink(j->path);
+    if (!E.filename)
+        return;
+
+    free(j->path);
+    j->path = editorSiblingPath(E.filename, ".swp");
+    struct stat st;
+    if (stat(E.filename, &st) == 0)
+    {
+        j->file_size = st.st_size;
+        j->file_mtime = st.st_mtime;
+    }
+}
+
+/** Undo **/
+// undo and redo are two stacks of primitive edits, each with the bytes
+// of its records in one growing arena. records of the same key undo
+// together; typing and deleting in a run extend the previous record
+// instead of adding one per key, and rows inserted by a key (a paste)
+// are a single U_ROWS record that edits inside them don't add to
+void undoStackClear(struct undoStack *st)
+{
+    st->n = 0;
+    st->used = 0;
+}
+
+long undoStackBytes(struct undoStack *st)
+{
+    return st->used + (long)st->n * sizeof(struct undoRec);
+}
+
+// drop the oldest records until the history fits in 3/4 of the cap
+// (undoing is still consistent, it just can't go back as far)
+void undoStackTrim(struct undoStack *st, long keep)
+{
+    int k = 0;
+    long drop = undoStackBytes(st) - keep;
+    while (k < st->n - 1 && drop > 0)
+    {
+        drop -= st->rec[k].len + sizeof(struct undoRec);
+        k++;
+    }
+    if (!k)
+        return;
+
+    long base = st->rec[k].off;
+    memmove(st->arena, st->arena + base, st->used - base);
+    st->used -= base;
+    memmove(st->rec, st->rec + k, sizeof(struct undoRec) * (st->n - k));
+    st->n -= k;
+    for (int i = 0; i < st->n; i++)
+        st->rec[i].off -= base;
+
+    if (st == &E.undo.undo)
+        E.undo.open = E.undo.open >= k ? E.undo.open - k : -1;
+}
+
+void undoArenaReserve(struct undoStack *st, long len)
+{
+    if (st->used + len <= st->size)
+        return;
+    st->size = (st->used + len) * 2;
+    st->arena = memRealloc(MEM_UNDO, st->arena, st->size);
+}
+
+struct undoRec *undoPush(struct undoStack *st, struct undoRec *r, const char *s, int len,
+                         const char *s2, int len2)
+{
+    if (st->n == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->rec = memRealloc(MEM_UNDO, st->rec, sizeof(struct undoRec) * st->cap);
+    }
+    undoArenaReserve(st, len + len2);
+    struct undoRec *top = &st->rec[st->n++];
+    *top = *r;
+    top->off = st->used;
+    top->len = len + len2;
+    memcpy(st->arena + st->used, s, len);
+    memcpy(st->arena + st->used + len, s2, len2);
+    st->used += len + len2;
+
+    if (E.undo.cap && undoStackBytes(st) > E.undo.cap)
+    {
+        undoStackTrim(st, E.undo.cap / 4 * 3);
+        top = &st->rec[st->n - 1];
+    }
+    return top;
+}
+
+// rows inserted by the current key are deleted wholesale when it is
+// undone, so edits inside them need no records of their own. returns 1
+// if the open U_ROWS record took the edit
+int editorUndoAbsorb(int op, int row)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->open < 0)
+        return 0;
+    struct undoRec *r = &u->undo.rec[u->open];
+    if (r->seq != u->seq)
+    {
+        u->open = -1;
+        return 0;
+    }
+
+    int lo = r->row, hi = r->row + r->at;
+    if (op == U_ROWS && row >= lo && row <= hi)
+    {
+        r->at++;
+        return 1;
+    }
+    if (op == U_DEL_ROW && row >= lo && row < hi)
+    {
+        r->at--;
+        return 1;
+    }
+    if (op != U_ROWS && op != U_DEL_ROW && row >= lo && row < hi)
+        return 1;
+
+    // edits past the run would be undone before it with stale row
+    // numbers if it kept growing, and rows coming or going above it
+    // move it; either way it takes no more
+    if (row >= hi || op == U_ROWS || op == U_DEL_ROW)
+        u->open = -1;
+    return 0;
+}
+
+// whether record r can take one more byte at column at, typed or deleted by this key
+int editorUndoExtends(struct undoRec *r, int op, int row, int at, char c)
+{
+    struct editorUndo *u = &E.undo;
+    if (r->op != op || r->row != row || (r->last != u->seq && r->last + 1 != u->seq))
+        return 0;
+    if (op == U_INSERT)
+    {
+        // a new word starts a new step
+        char prev = u->undo.arena[r->off + r->len - 1];
+        return at == r->at + r->len && !(isspace((unsigned char)c) && !isspace((unsigned char)prev));
+    }
+    return at == r->at || at == r->at - 1;
+}
+
+void editorUndoRecord(int op, int row, int at, const char *s, int len, const char *s2, int len2)
+{
+    struct editorUndo *u = &E.undo;
+    if (u->applying || u->loading)
+        return;
+
+    // a new edit makes what was undone unreachable
+    undoStackClear(&u->redo);
+    if (editorUndoAbsorb(op, row))
+        return;
+
+    struct undoStack *st = &u->undo;
+    struct undoRec *top = st->n ? &st->rec[st->n - 1] : NULL;
+    if (top && (op == U_INSERT || op == U_DELETE) && editorUndoExtends(top, op, row, at, s[0]))
+    {
+        undoArenaReserve(st, 1);
+        char *bytes = st->arena + top->off;
+        if (op == U_DELETE && at == top->at - 1)
+        {
+            // backspace, the byte goes in front
+            memmove(bytes + 1, bytes, top->len);
+            bytes[0] = s[0];
+            top->at--;
+        }
+        else
+        {
+            bytes[top->len] = s[0];
+        }
+        top->len++;
+        st->used++;
+        top->last = u->seq;
+        return;
+    }
+
+    struct undoRec r = {op, row, at, 0, 0, u->seq, u->seq, E.cx, E.cy};
+    if (op == U_ROWS)
+        r.at = 1;
+    undoPush(st, &r, s, len, s2, len2);
+    if (op == U_ROWS)
+        u->open = st->n - 1;
+}
+
+// replace del bytes at column at of row with s
+void editorUndoSplice(int row, int at, int del, const char *s, int len)
+{
+    erow *r = &E.row[row];
+    const char *old = editorRowPeek(r);
+    char *buf = memMalloc(MEM_SCRATCH, r->size - del + len + 1);
+    memcpy(buf, old, at);
+    memcpy(buf + at, s, len);
+    memcpy(buf + at + len, old + at + del, r->size - at - del);
+    editorRowSetChars(r, buf, r->size - del + len);
+    editorUpdateRow(r);
+    memFree(MEM_SCRATCH, buf);
+}
+
+// the rows of a U_ROWS record, newline separated, so redo can put them back
+char *editorUndoJoinRows(int at, int n, int *len)
+{
+    int total = 0, j;
+    for (j = at; j < at + n; j++)
+        total += E.row[j].size + 1;
+    char *buf = memMalloc(MEM_SCRATCH, total + 1);
+    char *p = buf;
+    for (j = at; j < at + n; j++)
+    {
+        memcpy(p, editorRowPeek(&E.row[j]), E.row[j].size);
+        p += E.row[j].size;
+        *p++ = '\n';
+    }
+    *len = total ? total - 1 : 0;
+    return buf;
+}
+
+// take back or reapply one record; undone records go on the redo stack
+// and the other way around
+void editorUndoApply(struct undoRec *r, const char *bytes, int undo)
+{
+    struct undoStack *to = undo ? &E.undo.redo : &E.undo.undo;
+    int oldlen = r->at;
+    switch (r->op)
+    {
+        case U_INSERT:
+        case U_DELETE:
+            if ((r->op == U_INSERT) == undo)
+                editorUndoSplice(r->row, r->at, r->len, NULL, 0);
+            else
+                editorUndoSplice(r->row, r->at, 0, bytes, r->len);
+            break;
+        case U_ROWS:
+            if (undo)
+            {
+                int len;
+                char *rows = editorUndoJoinRows(r->row, r->at, &len);
+                editorDelRows(r->row, r->at);
+                undoPush(to, r, rows, len, NULL, 0);
+                memFree(MEM_SCRATCH, rows);
+                return;
+            }
+            editorInsertRows(r->row, bytes, r->len);
+            bytes = NULL;
+            r->len = 0;
+            break;
+        case U_DEL_ROW:
+            if (undo)
+                editorInsertRow(r->row, (char *)bytes, r->len);
+            else
+                editorDelRow(r->row);
+            break;
+        case U_APPEND:
+        case U_TRUNCATE:
+            if ((r->op == U_APPEND) == undo)
+                editorRowTruncate(&E.row[r->row], r->at);
+            else
+                editorRowAppendString(&E.row[r->row], (char *)bytes, r->len);
+            break;
+        case U_SET:
+            if (undo)
+                editorRowSetChars(&E.row[r->row], (char *)bytes, oldlen);
+            else
+                editorRowSetChars(&E.row[r->row], (char *)bytes + oldlen, r->len - oldlen);
+            editorUpdateRow(&E.row[r->row]);
+            break;
+    }
+    undoPush(to, r, bytes, r->len, NULL, 0);
+}
+
+// undo (or redo) every record of the most recent key
+void editorUndoStep(int undo)
+{
+    struct editorUndo *u = &E.undo;
+    struct undoStack *from = undo ? &u->undo : &u->redo;
+    if (!from->n)
+    {
+        editorSetStatusMessage(undo ? "Nothing to undo" : "Nothing to redo");
+        return;
+    }
+
+    long long span = traceBegin();
+    unsigned seq = from->rec[from->n - 1].seq;
+    int count = 0;
+    u->applying = 1;
+    u->open = -1;
+    while (from->n && from->rec[from->n - 1].seq == seq)
+    {
+        struct undoRec r = from->rec[--from->n];
+        from->used = r.off;
+        editorUndoApply(&r, from->arena + r.off, undo);
+        count++;
+
+        // undo puts the cursor back where it was, redo after the edit
+        E.cy = r.row;
+        if (undo)
+        {
+            E.cx = r.cx;
+            E.cy = r.cy;
+        }
+        else if (r.op == U_INSERT)
+            E.cx = r.at + r.len;
+        else if (r.op == U_ROWS)
+            E.cx = 0;
+        else
+            E.cx = r.at;
+    }
+    u->applying = 0;
+
+    if (E.cy > E.numrows)
+        E.cy = E.numrows;
+    if (E.cx > (E.cy < E.numrows ? E.row[E.cy].size : 0))
+        E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+    traceEnd(undo ? "undo" : "redo", span, count);
+}
+
+/** File i/o **/
+char *editorRowsToString(int *buflen)
+{
+    // creates a string with all rows
+    int j;
+    int totlen = 0;
+
+    // calculate the amount of memory
+    for (j = 0; j < E.numrows; j++)
+        totlen += E.row[j].size + 1; // 1 for the \n at every line
+
+    *buflen = totlen;
+    
+    char *buf = memMalloc(MEM_SCRATCH, totlen);
+    char *p = buf; //we will advance p, but buf will remain at the start
+
+    for (j = 0; j < E.numrows; j++)
+    {
+        memcpy(p, editorRowPeek(&E.row[j]), E.row[j].size);
+        p += E.row[j].size;
+        *p = '\n';
+        p++;
+
+    }
+
+    return buf;
+}
+// remember the size and mtime of the file, so we notice if it changes under us
+void editorDiskStat()
+{
+    struct stat st;
+    E.disk_valid = (E.filename && stat(E.filename, &st) == 0);
+    if (E.disk_valid)
+    {
+        E.disk_size = st.st_size;
+        E.disk_mtime = st.st_mtime;
+    }
+}
+
+// start over with an empty file on disk, before loading it
+void editorHashReset()
+{
+    struct editorHash *hs = &E.hash;
+    hs->disk_sum = hs->disk_poly = 0;
+    hs->disk_pow = 1;
+    hs->disk_last_pow = 0;
+    hs->disk_rows = 0;
+    hs->disk_known = 1;
+}
+
+// a row was read from the file
+void editorHashDiskAppend(uint64_t h)
+{
+    struct editorHash *hs = &E.hash;
+    hs->disk_sum += h;
+    hs->disk_poly += h * hs->disk_pow;
+    hs->disk_last_pow = hs->disk_pow;
+    hs->disk_pow *= KILO_HASH_MUL;
+    hs->disk_rows++;
+}
+
+// the rows were just written out as they are
+void editorHashSaved()
+{
+    editorHashReset();
+    for (int j = 0; j < E.numrows; j++)
+        editorHashDiskAppend(E.row[j].hash);
+}
+
+// whether the buffer holds what is on disk. the counts and sums settle it
+// in O(1) unless they agree, and then the order is checked as well
+int editorBufferPristine()
+{
+    struct editorHash *hs = &E.hash;
+    if (!hs->disk_known || E.numrows != hs->disk_rows || hs->sum != hs->disk_sum)
+        return 0;
+    uint64_t poly = 0, pow = 1;
+    for (int j = 0; j < E.numrows; j++)
+    {
+        poly += E.row[j].hash * pow;
+        pow *= KILO_HASH_MUL;
+    }
+    return poly == hs->disk_poly;
+}
+
+// edits that take the buffer back to the file (undoing them, or typing
+// back what was deleted) leave it unmodified
+void editorCheckPristine()
+{
+    if (E.dirty && editorBufferPristine())
+    {
+        E.dirty = 0;
+        editorJournalReset();
+    }
+}
+
+int editorCompareHash(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// the file changed under us: hash its lines, skip the head and tail it
+// shares with the rows and count what is left on either side
+void editorDiskDiff()
+{
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return;
+    }
+    const char *map = NULL;
+    if (st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    int n = 0, cap = 1024;
+    uint64_t *disk = memMalloc(MEM_SCRATCH, cap * sizeof(uint64_t));
+    const char *p = map, *end = map + st.st_size;
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        int rawlen = nl ? nl - p + 1 : end - p;
+        int len = nl ? rawlen - 1 : rawlen;
+        while (len > 0 && p[len - 1] == '\r')
+            len--;
+        if (n == cap)
+        {
+            cap *= 2;
+            disk = memRealloc(MEM_SCRATCH, disk, cap * sizeof(uint64_t));
+        }
+        disk[n++] = editorHashRow(p, len);
+        p += rawlen;
+    }
+    if (map)
+        munmap((void *)map, st.st_size);
+
+    int head = 0, tail = 0;
+    while (head < n && head < E.numrows && disk[head] == E.row[head].hash)
+        head++;
+    while (tail < n - head && tail < E.numrows - head &&
+           disk[n - 1 - tail] == E.row[E.numrows - 1 - tail].hash)
+        tail++;
+    if (head == n && n == E.numrows)
+    {
+        editorSetStatusMessage("%.20s changed on disk, to what the buffer has", E.filename);
+        memFree(MEM_SCRATCH, disk);
+        return;
+    }
+
+    // lines only the file has, and rows only the buffer has
+    int dn = n - head - tail, bn = E.numrows - head - tail;
+    uint64_t *buf = memMalloc(MEM_SCRATCH, (bn + 1) * sizeof(uint64_t));
+    for (int j = 0; j < bn; j++)
+        buf[j] = E.row[head + j].hash;
+    qsort(disk + head, dn, sizeof(uint64_t), editorCompareHash);
+    qsort(buf, bn, sizeof(uint64_t), editorCompareHash);
+    int i = 0, j = 0, added = 0, gone = 0;
+    while (i < dn || j < bn)
+    {
+        if (j == bn || (i < dn && disk[head + i] < buf[j]))
+            added++, i++;
+        else if (i == dn || buf[j] < disk[head + i])
+            gone++, j++;
+        else
+            i++, j++;
+    }
+    if (dn)
+        editorSetStatusMessage("%.20s changed on disk: lines %d-%d differ (+%d -%d)",
+                               E.filename, head + 1, head + dn, added, gone);
+    else
+        editorSetStatusMessage("%.20s changed on disk: %d lines gone at line %d",
+                               E.filename, gone, head + 1);
+    memFree(MEM_SCRATCH, buf);
+    memFree(MEM_SCRATCH, disk);
+}
+
+// between keys, at most once a second, see whether someone else wrote
+// the file (--follow has its own watch)
+void editorDiskCheck()
+{
+    struct editorHash *hs = &E.hash;
+    time_t now = time(NULL);
+    if (now == hs->checked || !E.disk_valid || E.follow.ifd != -1 || E.load->active)
+        return;
+    hs->checked = now;
+
+    struct stat st;
+    if (stat(E.filename, &st) == -1 ||
+        (st.st_size == E.disk_size && st.st_mtime == E.disk_mtime) ||
+        (st.st_size == hs->seen_size && st.st_mtime == hs->seen_mtime))
+        return;
+    hs->seen_size = st.st_size;
+    hs->seen_mtime = st.st_mtime;
+    editorDiskDiff();
+}
+
+/** Index **/
+// hash a few samples of the file, cheap enough to do on every open and
+// enough to tell an edited file from the one the index was made for
+uint64_t editorIndexSample(int fd, long long size)
+{
+    char buf[KILO_INDEX_SAMPLE * 3];
+    long long at[3] = {0, size / 2, size - KILO_INDEX_SAMPLE};
+    int len = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        ssize_t n = pread(fd, buf + len, KILO_INDEX_SAMPLE, at[k] > 0 ? at[k] : 0);
+        len += n > 0 ? n : 0;
+    }
+    return editorHashBytes(buf, len);
+}
+
+// map the sidecar of the file being opened if it still describes it
+void editorIndexOpen(int fd)
+{
+    struct editorIndex *ix = &E.index;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return;
+    ix->sample = editorIndexSample(fd, st.st_size);
+    if (st.st_size < KILO_INDEX_MIN_SIZE)
+        return;
+
+    char *path = editorSiblingPath(E.filename, ".idx");
+    int ifd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    struct stat ist;
+    if (ifd == -1)
+        return;
+    if (fstat(ifd, &ist) == -1 || ist.st_size < (off_t)sizeof(struct indexHeader))
+    {
+        close(ifd);
+        return;
+    }
+    void *map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, ifd, 0);
+    close(ifd);
+    if (map == MAP_FAILED)
+        return;
+
+    const struct indexHeader *h = map;
+    long long blocks = ((long long)h->rows + KILO_INDEX_BLOCK - 1) / KILO_INDEX_BLOCK;
+    if (memcmp(h->magic, KILO_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->size != (uint64_t)st.st_size || h->mtime != (int64_t)st.st_mtime ||
+        h->sample != ix->sample || h->block != KILO_INDEX_BLOCK || h->rows > INT_MAX ||
+        ist.st_size != (off_t)(sizeof(*h) + ((long long)h->rows + 1) * sizeof(uint64_t) + blocks))
+    {
+        munmap(map, ist.st_size);
+        return;
+    }
+    ix->map = map;
+    ix->maplen = ist.st_size;
+    ix->rows = h->rows;
+    ix->off = (const uint64_t *)(h + 1);
+    ix->open = (const unsigned char *)(ix->off + ix->rows + 1);
+    ix->lazy = E.syntax && E.syntax->multiline_comment_start;
+}
+
+void editorIndexClose()
+{
+    struct editorIndex *ix = &E.index;
+    if (ix->map)
+        munmap(ix->map, ix->maplen);
+    ix->map = NULL;
+}
+
+// the file doesn't split into rows where the index says, so its comment
+// states can't be trusted either: highlight what is loaded the slow way
+void editorIndexDrop()
+{
+    editorIndexClose();
+    for (int j = 0; j < E.numrows; j++)
+        editorHighlightRow(&E.row[j]);
+}
+
+// a new row the index knows about. render and hl wait until it is drawn,
+// and its comment state until a row after it is highlighted, unless it
+// ends a block and the index has it
+void editorIndexRow(erow *row)
+{
+    struct editorIndex *ix = &E.index;
+    int i = row->idx;
+    if (i >= ix->rows || ix->off[i] != (uint64_t)row->orig_off ||
+        ix->off[i + 1] != (uint64_t)(row->orig_off + row->orig_len))
+    {
+        editorIndexDrop();
+        return;
+    }
+    row->hl_open_comment = 0;
+    if (ix->lazy)
+    {
+        int last = (i % KILO_INDEX_BLOCK == KILO_INDEX_BLOCK - 1 || i == ix->rows - 1);
+        row->hl_open_comment = last ? ix->open[i / KILO_INDEX_BLOCK] : -1;
+    }
+}
+
+struct indexWrite
+{
+    char *path;
+    char *buf;
+    size_t len;
+};
+
+void *editorIndexWriter(void *arg)
+{
+    struct indexWrite *w = arg;
+    int len = strlen(w->path) + 5;
+    char *tmp = malloc(len);
+    snprintf(tmp, len, "%s.tmp", w->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1)
+    {
+        int ok = write(fd, w->buf, w->len) == (ssize_t)w->len;
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(tmp, w->path) == -1)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(w->path);
+    free(w->buf);
+    free(w);
+    return NULL;
+}
+
+// don't let exit cut an index short, it only takes a moment to write
+void editorIndexWait()
+{
+    for (int k = 0; k < E.nbufs; k++)
+    {
+        struct editorIndex *ix = k == E.curbuf ? &E.index : &E.bufs[k].index;
+        if (ix->writing)
+            pthread_join(ix->writer, NULL);
+        ix->writing = 0;
+    }
+}
+
+// the file was loaded the slow way, write its index in the background
+// so the next open is quick
+void editorIndexSave()
+{
+    struct editorIndex *ix = &E.index;
+    if (E.load->size < KILO_INDEX_MIN_SIZE || E.dirty || !E.numrows ||
+        !E.disk_valid || E.disk_size != E.load->off)
+        return;
+
+    int rows = E.numrows;
+    long long blocks = ((long long)rows + KILO_INDEX_BLOCK - 1) / KILO_INDEX_BLOCK;
+    struct indexWrite *w = malloc(sizeof(*w));
+    w->len = sizeof(struct indexHeader) + ((long long)rows + 1) * sizeof(uint64_t) + blocks;
+    w->buf = malloc(w->len);
+    w->path = editorSiblingPath(E.filename, ".idx");
+
+    struct indexHeader *h = (struct indexHeader *)w->buf;
+    memcpy(h->magic, KILO_INDEX_MAGIC, sizeof(h->magic));
+    h->size = E.disk_size;
+    h->mtime = E.disk_mtime;
+    h->sample = ix->sample;
+    h->rows = rows;
+    h->block = KILO_INDEX_BLOCK;
+    uint64_t *off = (uint64_t *)(h + 1);
+    unsigned char *open = (unsigned char *)(off + rows + 1);
+    for (int j = 0; j < rows; j++)
+        off[j] = E.row[j].orig_off;
+    off[rows] = E.load->off;
+    for (long long k = 0; k < blocks; k++)
+    {
+        long long last = (k + 1) * KILO_INDEX_BLOCK - 1;
+        open[k] = E.row[last < rows ? last : rows - 1].hl_open_comment > 0;
+    }
+
+    editorIndexWait();
+    if (pthread_create(&ix->writer, NULL, editorIndexWriter, w) == 0)
+    {
+        ix->writing = 1;
+        return;
+    }
+    free(w->path);
+    free(w->buf);
+    free(w);
+}
+
+void *editorLoadThread(void *arg)
+{
+    struct editorLoad *l = arg;
+    int size = KILO_LOAD_FIRST_CHUNK;
+    while (1)
+    {
+        // memMalloc's counters belong to the ui thread, chunks are
+        // short lived and bounded by KILO_LOAD_QUEUE anyway
+        struct loadChunk *c = malloc(sizeof(struct loadChunk) + size);
+        int len = 0;
+        ssize_t n;
+        while (len < size && ((n = read(l->fd, c->data + len, size - len)) > 0 ||
+                              (n == -1 && errno == EINTR)))
+            len += n > 0 ? n : 0;
+        if (len == 0)
+        {
+            free(c);
+            break;
+        }
+        c->len = len;
+        c->next = NULL;
+
+        pthread_mutex_lock(&l->lock);
+        while (l->queued >= KILO_LOAD_QUEUE && !l->stop)
+            pthread_cond_wait(&l->space, &l->lock);
+        if (l->stop)
+        {
+            pthread_mutex_unlock(&l->lock);
+            free(c);
+            return NULL;
+        }
+        if (l->tail)
+            l->tail->next = c;
+        else
+            l->head = c;
+        l->tail = c;
+        l->queued++;
+        pthread_cond_signal(&l->more);
+        pthread_mutex_unlock(&l->lock);
+        ssize_t w = write(l->wakefd[1], "", 1);
+        (void)w;
+        size = KILO_LOAD_CHUNK;
+    }
+
+    pthread_mutex_lock(&l->lock);
+    l->eof = 1;
+    pthread_cond_signal(&l->more);
+    pthread_mutex_unlock(&l->lock);
+    ssize_t w = write(l->wakefd[1], "", 1);
+    (void)w;
+    return NULL;
+}
+
+// append the lines in buf as rows, the last one may lack its newline
+// (only at the end of the file)
+void editorLoadLines(const char *buf, int len)
+{
+    struct editorLoad *l = E.load;
+    int n = 0, j;
+    for (j = 0; j < len; j++)
+        if (buf[j] == '\n')
+            n++;
+    if (len && buf[len - 1] != '\n')
+        n++;
+    if (!n)
+        return;
+
+    // search workers may be reading the rows we already have
+    pthread_rwlock_wrlock(&E.rowlock);
+    E.row = memRealloc(MEM_ROWS, E.row, sizeof(erow) * (E.numrows + n));
+    pthread_rwlock_unlock(&E.rowlock);
+
+    const char *p = buf, *end = buf + len;
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        int rawlen = nl ? nl - p + 1 : end - p;
+        int linelen = rawlen;
+        while (linelen > 0 && (p[linelen - 1] == '\r' || p[linelen - 1] == '\n'))
+            linelen--;
+
+        erow *row = &E.row[E.numrows];
+        memset(row, 0, sizeof(erow));
+        row->idx = E.numrows;
+        row->size = linelen;
+        row->chars = memMalloc(MEM_CHARS, linelen + 1);
+        memcpy(row->chars, p, linelen);
+        row->chars[linelen] = '\0';
+        // remember where the row lives on disk so save can skip it
+        row->orig_off = l->off;
+        row->orig_len = rawlen;
+        row->last_used = E.tick;
+        l->off += rawlen;
+        E.numrows++;
+        editorRowRehash(row);
+        editorHashDiskAppend(row->hash);
+        row->br.minpre = 1;
+        if (E.index.map)
+        {
+            editorIndexRow(row);
+            editorWrapUpdateRow(row);
+        }
+        else
+            editorUpdateRow(row);
+        p += rawlen;
+    }
+    E.wrap.dirty = 1;
+    E.brackets.dirty = 1;
+}
+
+void editorLoadCarry(const char *p, int len)
+{
+    struct editorLoad *l = E.load;
+    if (l->carry_len + len > l->carry_cap)
+    {
+        l->carry_cap = (l->carry_len + len) * 2;
+        l->carry = memRealloc(MEM_SCRATCH, l->carry, l->carry_cap);
+    }
+    memcpy(l->carry + l->carry_len, p, len);
+    l->carry_len += len;
+}
+
+// make rows out of the current chunk until it runs out or the deadline
+// (0 = none) passes. returns 1 once the chunk is used up
+int editorLoadChunk(long long deadline)
+{
+    struct editorLoad *l = E.load;
+    struct loadChunk *c = l->cur;
+    const char *p = c->data + l->pos, *end = c->data + c->len;
+
+    // finish the line the last chunk cut
+    if (l->carry_len)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *upto = nl ? nl + 1 : end;
+        editorLoadCarry(p, upto - p);
+        if (!nl)
+            return 1;
+        editorLoadLines(l->carry, l->carry_len);
+        l->carry_len = 0;
+        p = upto;
+    }
+
+    while (p < end)
+    {
+        const char *q = p, *nl;
+        for (int n = 0; n < KILO_LOAD_BATCH && (nl = memchr(q, '\n', end - q)); n++)
+            q = nl + 1;
+        if (q == p)
+            break; // no complete line left
+        editorLoadLines(p, q - p);
+        p = q;
+        if (deadline && editorNowNs() > deadline)
+        {
+            l->pos = p - c->data;
+            return p == end;
+        }
+    }
+    editorLoadCarry(p, end - p);
+    return 1;
+}
+
+// the whole file is in
+void editorLoadDone()
+{
+    struct editorLoad *l = E.load;
+    int partial = l->carry_len > 0;
+    editorLoadLines(l->carry, l->carry_len);
+    if (E.index.map && E.numrows != E.index.rows)
+        editorIndexDrop();
+    memFree(MEM_SCRATCH, l->carry);
+    l->carry = NULL;
+    l->carry_len = l->carry_cap = 0;
+
+    pthread_join(l->thread, NULL);
+    close(l->wakefd[0]);
+    close(l->wakefd[1]);
+    l->active = 0;
+    editorDiskStat();
+    if (E.index.map)
+        editorIndexClose();
+    else
+        editorIndexSave();
+    editorEnforceBudget();
+    traceEnd("open", l->span, E.numrows);
+    if (E.follow.on)
+        editorFollowStart(partial); // takes over l->fd
+    else
+        close(l->fd);
+}
+
+// turn queued chunks into rows, for KILO_LOAD_SLICE_MS at most unless
+// wait is set, in which case it keeps going until the file is in.
+// returns 1 if there are new rows
+int editorLoadStep(int wait)
+{
+    struct editorLoad *l = E.load;
+    if (!l->active)
+        return 0;
+
+    long long deadline = wait ? 0 : editorNowNs() + KILO_LOAD_SLICE_MS * 1000000LL;
+    int rows = E.numrows;
+    while (1)
+    {
+        int eof = 0;
+        if (!l->cur)
+        {
+            pthread_mutex_lock(&l->lock);
+            while (wait && !l->head && !l->eof)
+                pthread_cond_wait(&l->more, &l->lock);
+            l->cur = l->head;
+            l->pos = 0;
+            if (l->cur)
+            {
+                l->head = l->cur->next;
+                if (!l->head)
+                    l->tail = NULL;
+                l->queued--;
+                pthread_cond_signal(&l->space);
+            }
+            eof = l->eof && !l->cur;
+            pthread_mutex_unlock(&l->lock);
+        }
+        if (eof)
+        {
+            editorLoadDone();
+            return 1;
+        }
+        if (!l->cur)
+            break; // the reader is behind, it wakes us when it has more
+
+        if (editorLoadChunk(deadline))
+        {
+            free(l->cur);
+            l->cur = NULL;
+        }
+        if (deadline && editorNowNs() > deadline)
+        {
+            // come back after looking at the keyboard
+            ssize_t w = write(l->wakefd[1], "", 1);
+            (void)w;
+            break;
+        }
+    }
+    if (E.numrows != rows)
+        editorEnforceBudget();
+    return E.numrows != rows;
+}
+
+// the buffer is closed before its file is in: stop the reader and
+// drop what it read ahead
+void editorLoadStop()
+{
+    struct editorLoad *l = E.load;
+    if (!l->active)
+        return;
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_signal(&l->space);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->thread, NULL);
+
+    while (l->head)
+    {
+        struct loadChunk *c = l->head;
+        l->head = c->next;
+        free(c);
+    }
+    free(l->cur);
+    l->cur = NULL;
+    l->tail = NULL;
+    memFree(MEM_SCRATCH, l->carry);
+    l->carry = NULL;
+    l->carry_len = l->carry_cap = 0;
+    close(l->wakefd[0]);
+    close(l->wakefd[1]);
+    close(l->fd);
+    l->active = 0;
+    l->stop = 0;
+    if (E.index.map)
+        editorIndexClose();
+}
+
+int editorLoadPoll()
+{
+    return editorLoadStep(0);
+}
+
+// whole buffer operations (save, replace) need the whole file
+void editorLoadFinish()
+{
+    if (E.load->active)
+        editorLoadStep(1);
+}
+
+// drop the rows and everything tied to them, before another file (or
+// the grep results) takes their place
+void editorCloseFile()
+{
+    editorLoadFinish();
+    editorFollowStop();
+    editorSearchCancel();
+    editorSearchRestoreHighlight();
+    E.search.last_match = -1;
+    pthread_rwlock_wrlock(&E.rowlock);
+    for (int j = 0; j < E.numrows; j++)
+        editorFreeFow(&E.row[j]);
+    memFree(MEM_ROWS, E.row);
+    E.row = NULL;
+    E.numrows = 0;
+    pthread_rwlock_unlock(&E.rowlock);
+    undoStackClear(&E.undo.undo);
+    undoStackClear(&E.undo.redo);
+    E.undo.open = -1;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+    editorFoldClear();
+    editorJournalReset();
+    E.brackets.dirty = 1;
+}
+
+void editorOpen(char *filename)
+{
+    struct editorLoad *l = E.load;
+    l->span = traceBegin();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    l->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (l->fd == -1)
+        die("fopen");
+
+    struct stat st;
+    l->size = fstat(l->fd, &st) == 0 ? st.st_size : 0;
+    editorIndexOpen(l->fd);
+    editorHashReset();
+    l->off = 0;
+    l->eof = 0;
+    l->head = l->tail = NULL;
+    l->cur = NULL;
+    l->queued = 0;
+    if (pipe2(l->wakefd, O_NONBLOCK | O_CLOEXEC) == -1)
+        die("pipe");
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->space, NULL);
+    pthread_cond_init(&l->more, NULL);
+    if (pthread_create(&l->thread, NULL, editorLoadThread, l) != 0)
+        die("pthread_create");
+    l->active = 1;
+
+    // edits made while the rest streams in only touch rows already
+    // there, so the journal can take them from the start. a swap file
+    // to recover has to be replayed over the whole file though, and
+    // replayed scripts want the file in before their first key
+    char *swap = editorSiblingPath(filename, ".swp");
+    int recover = access(swap, F_OK) == 0;
+    free(swap);
+    if (E.headless || recover)
+    {
+        E.undo.loading = 1;
+        editorLoadFinish();
+        if (!E.headless)
+            editorJournalOpen(filename);
+        E.undo.loading = 0;
+    }
+    else
+    {
+        editorJournalOpen(filename);
+    }
+}
+
+/** Follow **/
+// watch the file itself for writes and its directory for a new file
+// taking its name (a rotated log)
+void editorFollowWatch()
+{
+    struct editorFollow *f = &E.follow;
+    struct stat st;
+    if (f->ifd != -1)
+        close(f->ifd);
+    f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->ifd == -1 || fstat(f->fd, &st) == -1 ||
+        inotify_add_watch(f->ifd, E.filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1)
+    {
+        editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+        if (f->ifd != -1)
+            close(f->ifd);
+        close(f->fd);
+        f->ifd = f->fd = -1;
+        f->on = 0;
+        return;
+    }
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+
+    char *dir = strdup(E.filename);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        slash[slash == dir] = '\0';
+    inotify_add_watch(f->ifd, slash ? dir : ".", IN_CREATE | IN_MOVED_TO);
+    free(dir);
+}
+
+void editorFollowStop()
+{
+    struct editorFollow *f = &E.follow;
+    if (f->ifd != -1)
+        close(f->ifd);
+    if (f->fd != -1)
+        close(f->fd);
+    f->ifd = f->fd = -1;
+}
+
+// the file is in, keep reading from where the loader stopped
+void editorFollowStart(int partial)
+{
+    struct editorFollow *f = &E.follow;
+    f->fd = E.load->fd;
+    f->partial = partial;
+    editorFollowWatch();
+    if (f->ifd == -1)
+        return;
+    if (f->pin && E.cy == 0 && E.numrows)
+        editorMoveToRow(E.numrows - 1);
+    f->pin = 0;
+    // catch what was written between the end of the load and the watch
+    editorFollowPoll();
+}
+
+// bytes written to the end of the last row, which had no newline yet.
+// done is set if the newline came with them
+void editorFollowExtend(erow *row, const char *s, int len, int done)
+{
+    editorRowEnsureChars(row);
+    // search workers may be reading the row, its chars and size change
+    // together for them
+    pthread_rwlock_wrlock(&E.rowlock);
+    row->chars = memRealloc(MEM_CHARS, row->chars, row->size + len + 1);
+    memcpy(row->chars + row->size, s, len);
+    row->size += len;
+    if (done && row->size && row->chars[row->size - 1] == '\r')
+        row->size--;
+    row->chars[row->size] = '\0';
+    pthread_rwlock_unlock(&E.rowlock);
+    row->orig_len += len + done;
+    E.load->off += len + done;
+
+    // the last row of the file grew, unless it was edited we know how
+    uint64_t old = row->hash;
+    editorRowRehash(row);
+    if (row->modified)
+        E.hash.disk_known = 0;
+    else
+    {
+        E.hash.disk_sum += row->hash - old;
+        E.hash.disk_poly += (row->hash - old) * E.hash.disk_last_pow;
+    }
+    editorUpdateRow(row);
+}
+
+// the file under us was truncated or replaced: start over with the new
+// one, unless that would throw away edits
+void editorFollowReopen(const char *what)
+{
+    struct editorFollow *f = &E.follow;
+    editorFollowStop();
+    if (E.dirty)
+    {
+        f->on = 0;
+        editorSetStatusMessage("%s was %s, stopped following to keep your changes", E.filename, what);
+        return;
+    }
+
+    f->pin = E.cy >= E.numrows - 1;
+    editorCloseFile();
+
+    char *filename = strdup(E.filename);
+    editorOpen(filename);
+    free(filename);
+    editorSetStatusMessage("%s was %s, reloaded", E.filename, what);
+}
+
+// read what was appended since last time into rows, only the new rows
+// get highlighted. returns 1 if anything changed
+int editorFollowRead()
+{
+    struct editorFollow *f = &E.follow;
+    struct editorLoad *l = E.load;
+    struct stat st;
+    if (fstat(f->fd, &st) == -1)
+        return 0;
+    if (st.st_size < l->off)
+    {
+        editorFollowReopen("truncated");
+        return 1;
+    }
+
+    int rows = E.numrows;
+    long long off = l->off;
+    int pinned = E.cy >= E.numrows - 1;
+    char *buf = memMalloc(MEM_SCRATCH, KILO_FOLLOW_READ);
+    ssize_t n;
+    while ((n = pread(f->fd, buf, KILO_FOLLOW_READ, l->off)) > 0)
+    {
+        const char *p = buf, *end = buf + n;
+        if (f->partial && E.numrows)
+        {
+            const char *nl = memchr(p, '\n', n);
+            int len = nl ? nl - p : n;
+            editorFollowExtend(&E.row[E.numrows - 1], p, len, nl != NULL);
+            f->partial = !nl;
+            p += len + (nl != NULL);
+        }
+        if (p < end)
+        {
+            editorLoadLines(p, end - p);
+            f->partial = end[-1] != '\n';
+        }
+    }
+    memFree(MEM_SCRATCH, buf);
+    if (l->off == off)
+        return 0;
+
+    // a journal not started yet should describe the file as it is now
+    if (E.journal.fd == -1)
+    {
+        E.journal.file_size = st.st_size;
+        E.journal.file_mtime = st.st_mtime;
+    }
+    editorDiskStat();
+    if (pinned && E.numrows > rows)
+        editorMoveToRow(E.numrows - 1);
+    editorEnforceBudget();
+    return 1;
+}
+
+// the watch fired: take in appended bytes, then see whether the name
+// now points at another file
+int editorFollowPoll()
+{
+    struct editorFollow *f = &E.follow;
+    char drain[4096];
+    while (read(f->ifd, drain, sizeof(drain)) > 0)
+        ;
+
+    int changed = editorFollowRead();
+    struct stat st;
+    if (f->ifd != -1 && stat(E.filename, &st) == 0 &&
+        (st.st_dev != f->dev || st.st_ino != f->ino))
+    {
+        editorFollowReopen("replaced");
+        changed = 1;
+    }
+    return changed;
+}
+
+// a save writes a new file and renames it over the old one, follow that
+void editorFollowSaved()
+{
+    struct editorFollow *f = &E.follow;
+    if (f->ifd == -1)
+        return;
+    close(f->fd);
+    f->fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    f->partial = 0;
+    if (f->fd == -1)
+    {
+        editorFollowStop();
+        f->on = 0;
+        return;
+    }
+    editorFollowWatch();
+}
+
+// a row whose bytes on disk are exactly what we would write
+int editorRowReusable(erow *row)
+{
+    return !row->modified && row->orig_off >= 0 && row->orig_len == row->size + 1;
+}
+
+// write rows [from, to) to fd starting at off
+// returns the number of bytes written, or -1 on error
+long long editorWriteRows(int fd, int from, int to, long long off)
+{
+    long long len = 0;
+    int j;
+    for (j = from; j < to; j++)
+        len += E.row[j].size + 1;
+
+    char *buf = memMalloc(MEM_SCRATCH, len);
+    char *p = buf;
+    for (j = from; j < to; j++)
+    {
+        memcpy(p, editorRowPeek(&E.row[j]), E.row[j].size);
+        p += E.row[j].size;
+        *p++ = '\n';
+    }
+
+    long long done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+        if (n <= 0)
+        {
+            memFree(MEM_SCRATCH, buf);
+            return -1;
+        }
+        done += n;
+    }
+    memFree(MEM_SCRATCH, buf);
+    return len;
+}
+
+// copy len bytes between files, in the kernel when the filesystem allows it
+int editorCopySpan(int in, long long inoff, int out, long long outoff, long long len)
+{
+    loff_t src = inoff, dst = outoff;
+    while (len > 0)
+    {
+        ssize_t n = copy_file_range(in, &src, out, &dst, len, 0);
+        if (n <= 0)
+        {
+            // e.g. EXDEV or an old kernel, fall back to a plain copy
+            char buf[65536];
+            n = pread(in, buf, len < (long long)sizeof(buf) ? len : (long long)sizeof(buf), src);
+            if (n <= 0 || pwrite(out, buf, n, dst) != n)
+                return -1;
+            src += n;
+            dst += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// save only what changed since the file was read
+// if no unchanged row moved, the changed rows are patched in place with pwrite;
+// otherwise a new file is put together with copy_file_range for the unchanged
+// spans and renamed over the old one, unless renaming would cut a symlink or
+// a hard link loose from it
+// returns 0 on success, -1 on error and 1 when a full rewrite is needed
+int editorSaveDelta(long long *written, long long *kept)
+{
+    struct stat st, lst;
+    if (!E.disk_valid || stat(E.filename, &st) == -1 || lstat(E.filename, &lst) == -1 ||
+        st.st_size != E.disk_size || st.st_mtime != E.disk_mtime)
+        return 1;
+    int linked = S_ISLNK(lst.st_mode) || st.st_nlink > 1;
+
+    int j;
+    long long off = 0, shifted = 0;
+    for (j = 0; j < E.numrows; j++)
+    {
+        erow *row = &E.row[j];
+        if (editorRowReusable(row) && row->orig_off != off)
+            shifted += row->size + 1;
+        off += row->size + 1;
+    }
+    long long total = off;
+    *written = *kept = 0;
+
+    if (shifted == 0)
+    {
+        int fd = open(E.filename, O_WRONLY);
+        if (fd == -1)
+            return -1;
+
+        off = 0;
+        j = 0;
+        while (j < E.numrows)
+        {
+            if (editorRowReusable(&E.row[j]))
+            {
+                *kept += E.row[j].size + 1;
+                off += E.row[j].size + 1;
+                j++;
+                continue;
+            }
+
+            int from = j;
+            long long start = off;
+            while (j < E.numrows && !editorRowReusable(&E.row[j]))
+            {
+                off += E.row[j].size + 1;
+                j++;
+            }
+            long long n = editorWriteRows(fd, from, j, start);
+            if (n == -1)
+            {
+                close(fd);
+                return -1;
+            }
+            *written += n;
+        }
+
+        // the journal goes once this returns, the rows must be on disk
+        if (ftruncate(fd, total) == -1 || fsync(fd) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        return 0;
+    }
+    if (linked)
+        return 1;
+
+    // O_EXCL so the name can't be a link planted to redirect the write;
+    // a temp file left behind by a crash is ours to replace
+    char *tmp = editorSiblingPath(E.filename, ".kilotmp");
+    int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (out == -1 && errno == EEXIST && unlink(tmp) == 0)
+        out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (out == -1)
+    {
+        free(tmp);
+        return 1;
+    }
+    // the new file takes the old one's place, so it needs its owner too;
+    // when that can't be given away only a rewrite in place keeps it
+    struct stat ost;
+    int owned = (fchown(out, st.st_uid, st.st_gid) == 0);
+    if (!owned && fstat(out, &ost) == 0)
+        owned = (ost.st_uid == st.st_uid && ost.st_gid == st.st_gid);
+    if (!owned || fchmod(out, st.st_mode & 07777) == -1)
+    {
+        close(out);
+        unlink(tmp);
+        free(tmp);
+        return 1;
+    }
+    int in = open(E.filename, O_RDONLY);
+    int ok = (in != -1);
+
+    off = 0;
+    j = 0;
+    while (ok && j < E.numrows)
+    {
+        int from = j;
+        long long start = off;
+        if (editorRowReusable(&E.row[j]))
+        {
+            // coalesce rows that are also contiguous in the old file
+            long long src = E.row[j].orig_off;
+            long long len = 0;
+            while (j < E.numrows && editorRowReusable(&E.row[j]) && E.row[j].orig_off == src + len)
+            {
+                len += E.row[j].size + 1;
+                j++;
+            }
+            ok = (editorCopySpan(in, src, out, start, len) == 0);
+            *kept += len;
+            off += len;
+        }
+        else
+        {
+            while (j < E.numrows && !editorRowReusable(&E.row[j]))
+            {
+                off += E.row[j].size + 1;
+                j++;
+            }
+            long long n = editorWriteRows(out, from, j, start);
+            ok = (n != -1);
+            *written += n;
+        }
+    }
+
+    if (ok)
+        ok = (fsync(out) == 0);
+    if (in != -1)
+        close(in);
+    close(out);
+    if (ok)
+        ok = (rename(tmp, E.filename) == 0);
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+// after a successful save every row sits where we just wrote it
+void editorSaveDone()
+{
+    long long off = 0;
+    for (int j = 0; j < E.numrows; j++)
+    {
+        E.row[j].modified = 0;
+        E.row[j].orig_off = off;
+        E.row[j].orig_len = E.row[j].size + 1;
+        off += E.row[j].size + 1;
+    }
+    E.dirty = 0;
+    E.load->off = off;
+    editorHashSaved();
+    editorDiskStat();
+    editorJournalReset();
+    editorFollowSaved();
+}
+
+void editorSaveToDisk()
+{
+    long long written, kept;
+    int delta = editorSaveDelta(&written, &kept);
+    if (delta == 0)
+    {
+        editorSetStatusMessage("%lld bytes written to disk (%lld unchanged)", written, kept);
+        editorSaveDone();
+        return;
+    }
+    if (delta == -1)
+    {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    int len;
+    char *buf = editorRowsToString(&len); // free this later
+
+    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1)
+    {
+        if (ftruncate64(fd, len) != -1)
+        {
+            if (write(fd, buf, len) == len && fsync(fd) == 0)
+            {
+                close(fd);
+                memFree(MEM_SCRATCH, buf);
+                editorSetStatusMessage("%d bytes written to disk", len);
+                editorSaveDone();
+                return;
+            }
+
+        }
+
+        close(fd);
+    }
+    memFree(MEM_SCRATCH, buf);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+void editorSave()
+{
+    editorLoadFinish();
+    if (E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (!E.filename)
+        {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+	editorSelectSyntaxHighlight();
+        E.disk_valid = 0;
+
+    }
+
+    long long span = traceBegin();
+    editorSaveToDisk();
+    traceEnd("save", span, E.numrows);
+}
+/** Buffers **/
+// E holds the buffer being edited and every other open file waits in
+// E.bufs, so the rest of the editor only ever deals with E and switching
+// is a copy each way
+void editorBufferStash(struct editorBuffer *b)
+{
+    editorJournalFlush();
+    b->cx = E.cx;
+    b->cy = E.cy;
+    b->rx = E.rx;
+    b->numrows = E.numrows;
+    b->rowoff = E.rowoff;
+    b->coloff = E.coloff;
+    b->dirty = E.dirty;
+    b->row = E.row;
+    b->filename = E.filename;
+    b->disk_valid = E.disk_valid;
+    b->disk_size = E.disk_size;
+    b->disk_mtime = E.disk_mtime;
+    b->syntax = E.syntax;
+    b->journal = E.journal;
+    b->undo = E.undo;
+    b->load = E.load;
+    b->follow = E.follow;
+    b->index = E.index;
+    b->hash = E.hash;
+    b->wrap = E.wrap;
+    b->folds = E.folds;
+    b->brackets = E.brackets;
+    b->coldcache = E.coldcache;
+}
+
+void editorBufferUnstash(struct editorBuffer *b)
+{
+    int wrap = E.wrap.on; // a setting of the editor, not of the file
+    E.cx = b->cx;
+    E.cy = b->cy;
+    E.rx = b->rx;
+    E.numrows = b->numrows;
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+    E.dirty = b->dirty;
+    E.row = b->row;
+    E.filename = b->filename;
+    E.disk_valid = b->disk_valid;
+    E.disk_size = b->disk_size;
+    E.disk_mtime = b->disk_mtime;
+    E.syntax = b->syntax;
+    E.journal = b->journal;
+    E.undo = b->undo;
+    E.load = b->load;
+    E.follow = b->follow;
+    E.index = b->index;
+    E.hash = b->hash;
+    E.wrap = b->wrap;
+    E.folds = b->folds;
+    E.brackets = b->brackets;
+    E.coldcache = b->coldcache;
+    if (E.wrap.on != wrap)
+        E.wrap.relayout = 1;
+    E.wrap.on = wrap;
+}
+
+// make buffer k the one in E, without showing it. search workers read
+// E.row, so this must not happen while a search runs
+void editorBufferUse(int k)
+{
+    if (k == E.curbuf)
+        return;
+    editorBufferStash(&E.bufs[E.curbuf]);
+    editorBufferUnstash(&E.bufs[k]);
+    E.curbuf = k;
+}
+
+// show buffer k
+void editorBufferSwitch(int k)
+{
+    if (k == E.curbuf)
+        return;
+    editorSearchCancel();
+    editorSearchRestoreHighlight();
+    E.search.last_match = -1;
+    editorBufferUse(k);
+    E.shownbuf = k;
+    editorInvalidateFrame();
+}
+
+// an empty buffer after the others, shown
+void editorBufferNew()
+{
+    E.bufs = memRealloc(MEM_ROWS, E.bufs, sizeof(struct editorBuffer) * (E.nbufs + 1));
+    struct editorBuffer *b = &E.bufs[E.nbufs];
+    memset(b, 0, sizeof(*b));
+    b->load = calloc(1, sizeof(struct editorLoad));
+    b->journal.fd = -1;
+    b->undo.open = -1;
+    b->follow.ifd = b->follow.fd = -1;
+    b->undo.cap = E.undo.cap;
+    editorBufferSwitch(E.nbufs++);
+    editorHashReset();
+}
+
+// the buffer that has path open, -1 if none
+int editorBufferFind(const char *path)
+{
+    for (int k = 0; k < E.nbufs; k++)
+    {
+        const char *name = k == E.curbuf ? E.filename : E.bufs[k].filename;
+        if (name && !strcmp(name, path))
+            return k;
+    }
+    return -1;
+}
+
+// show the buffer with path, opening it if no buffer has it yet. an
+// untouched empty buffer is used rather than kept around
+int editorBufferOpen(const char *path)
+{
+    int k = editorBufferFind(path);
+    if (k != -1)
+    {
+        editorBufferSwitch(k);
+        return 0;
+    }
+    if (access(path, R_OK) == -1)
+    {
+        editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (E.filename || E.numrows || E.dirty || E.grep.buffer == E.curbuf)
+        editorBufferNew();
+    char *name = strdup(path);
+    editorOpen(name);
+    free(name);
+    return 0;
+}
+
+// files after the first on the command line: they open out of sight
+// and load while the keyboard is idle
+void editorBufferOpenHidden(char *path)
+{
+    int shown = E.curbuf;
+    editorBufferNew();
+    editorOpen(path);
+    editorBufferSwitch(shown);
+}
+
+// drop the buffer shown and show the next one
+void editorBufferClose()
+{
+    if (E.nbufs == 1)
+    {
+        editorSetStatusMessage("This is the only buffer, Ctrl-Q quits");
+        return;
+    }
+    if (E.dirty)
+    {
+        editorSetStatusMessage("Save or undo the changes before closing");
+        return;
+    }
+
+    editorSearchCancel();
+    editorLoadStop();
+    editorCloseFile();
+    if (E.index.writing)
+        pthread_join(E.index.writer, NULL);
+    pthread_mutex_destroy(&E.load->lock);
+    free(E.load);
+    free(E.filename);
+    free(E.journal.path);
+    memFree(MEM_JOURNAL, E.journal.pending);
+    memFree(MEM_UNDO, E.undo.undo.rec);
+    memFree(MEM_UNDO, E.undo.undo.arena);
+    memFree(MEM_UNDO, E.undo.redo.rec);
+    memFree(MEM_UNDO, E.undo.redo.arena);
+    memFree(MEM_ROWS, E.wrap.tree);
+    memFree(MEM_ROWS, E.folds.all);
+    memFree(MEM_ROWS, E.folds.top);
+    memFree(MEM_ROWS, E.folds.hid);
+    memFree(MEM_ROWS, E.brackets.tree);
+    memFree(MEM_ROWS, E.brackets.count);
+    free(E.coldcache.data);
+
+    int k = E.curbuf;
+    memmove(&E.bufs[k], &E.bufs[k + 1], sizeof(struct editorBuffer) * (E.nbufs - k - 1));
+    E.nbufs--;
+    if (E.grep.buffer == k)
+        E.grep.buffer = -1;
+    else if (E.grep.buffer > k)
+        E.grep.buffer--;
+    E.curbuf = E.shownbuf = k < E.nbufs ? k : k - 1;
+    editorBufferUnstash(&E.bufs[E.curbuf]);
+    E.search.last_match = -1;
+    editorInvalidateFrame();
+}
+
+// buffers with changes not saved
+int editorBuffersDirty()
+{
+    int n = 0;
+    for (int k = 0; k < E.nbufs; k++)
+        n += (k == E.curbuf ? E.dirty : E.bufs[k].dirty) > 0;
+    return n;
+}
+
+// render and hl of buffers out of sight go first when memory is short,
+// then their text is compressed like that of cold rows
+void editorBufferEvictHidden(long long target)
+{
+    int cur = E.curbuf;
+    if (E.search.active)
+        return;
+    for (int k = 0; k < E.nbufs && memTotal() > target; k++)
+    {
+        if (k == E.shownbuf)
+            continue;
+        editorBufferUse(k);
+        for (int j = 0; j < E.numrows; j++)
+            if (E.row[j].render)
+                editorRowEvict(&E.row[j]);
+    }
+    for (int k = 0; k < E.nbufs && memTotal() > target; k++)
+    {
+        if (k == E.shownbuf)
+            continue;
+        editorBufferUse(k);
+        editorCompressCold(target);
+    }
+    editorBufferUse(cur);
+}
+
+// Ctrl-O
+void editorBufferPrompt()
+{
+    char *path = editorPrompt("Open: %s (ESC to cancel)", NULL);
+    if (!path)
+        return;
+    editorBufferOpen(path);
+    free(path);
+}
+
+/** Search **/
+// let the input loop know there is something new to show
+void editorSearchWake()
+{
+    // if the pipe is full the ui has a wakeup queued already
+    ssize_t n = write(E.search.wakefd[1], "", 1);
+    (void)n;
+}
+
+void *editorSearchWorker(void *arg)
+{
+    struct editorSearch *s = &E.search;
+    int id = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (1)
+    {
+        while (s->jobgen == seen)
+            pthread_cond_wait(&s->work, &s->lock);
+        seen = s->jobgen;
+        if (id >= s->nslices)
+            continue;
+
+        // copy the job so we can scan without holding the lock
+        char *query = s->query;
+        int qlen = s->qlen;
+        int origin = s->origin;
+        int direction = s->direction;
+        int numrows = s->numrows;
+        // slices are ranges of distance, not of row index, so slice 0
+        // always holds the matches nearest to the cursor
+        int from = (int)((long)numrows * id / s->nslices);
+        int to = (int)((long)numrows * (id + 1) / s->nslices);
+        pthread_mutex_unlock(&s->lock);
+
+        long long span = traceBegin();
+        long matches = 0;
+        int best_row = -1, best_off = 0, best_dist = 0;
+        int d = from;
+        while (d < to && __atomic_load_n(&s->generation, __ATOMIC_RELAXED) == seen)
+        {
+            int end = d + KILO_SEARCH_CHUNK;
+            if (end > to)
+                end = to;
+
+            // the ui may thaw or compress rows between chunks, which can
+            // free the block we have cached
+            struct coldCache cache = {NULL, NULL, 0};
+            pthread_rwlock_rdlock(&E.rowlock);
+
+            for (; d < end; d++)
+            {
+                int r = origin + 1 + d;
+                if (direction == -1)
+                    r = origin - 1 - d;
+                r %= numrows;
+                if (r < 0)
+                    r += numrows;
+
+                erow *row = &E.row[r];
+                const char *chars = coldPeek(row, &cache);
+                const char *p = chars;
+                const char *rend = chars + row->size;
+                const char *match;
+                while ((match = memmem(p, rend - p, query, qlen)) != NULL)
+                {
+                    if (best_row == -1)
+                    {
+                        // we walk in distance order, so the first hit is the nearest
+                        best_row = r;
+                        best_off = match - chars;
+                        best_dist = d;
+                    }
+                    matches++;
+                    p = match + qlen;
+                }
+            }
+            pthread_rwlock_unlock(&E.rowlock);
+            free(cache.data);
+
+            // publish what we have so the prompt can stream the count
+            pthread_mutex_lock(&s->lock);
+            if (s->jobgen == seen)
+            {
+                s->matches += matches;
+                if (best_row != -1 && (s->best_row == -1 || best_dist < s->best_dist))
+                {
+                    s->best_row = best_row;
+                    s->best_off = best_off;
+                    s->best_dist = best_dist;
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+            matches = 0;
+            editorSearchWake();
+        }
+
+        traceEnd("search slice", span, to - from);
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending == 0)
+        {
+            pthread_cond_broadcast(&s->done);
+            editorSearchWake();
+        }
+    }
+    return NULL;
+}
+
+void editorSearchInit()
+{
+    struct editorSearch *s = &E.search;
+    if (s->nthreads)
+        return;
+
+    if (pipe2(s->wakefd, O_NONBLOCK | O_CLOEXEC) == -1)
+        die("pipe2");
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (ncpu > KILO_SEARCH_MAX_THREADS)
+        ncpu = KILO_SEARCH_MAX_THREADS;
+
+    for (s->nthreads = 0; s->nthreads < ncpu; s->nthreads++)
+    {
+        if (pthread_create(&s->threads[s->nthreads], NULL, editorSearchWorker,
+                           (void *)(intptr_t)s->nthreads) != 0)
+        {
+            if (s->nthreads == 0)
+                die("pthread_create");
+            break;
+        }
+    }
+}
+
+// stop the scan in flight and wait until no worker touches the rows
+void editorSearchCancel()
+{
+    struct editorSearch *s = &E.search;
+    if (!s->nthreads)
+        return;
+
+    __atomic_add_fetch(&s->generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->lock);
+    while (s->pending > 0)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int editorSearchBusy()
+{
+    struct editorSearch *s = &E.search;
+    if (!s->nthreads)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    int busy = s->pending > 0;
+    pthread_mutex_unlock(&s->lock);
+    return busy;
+}
+
+void editorSearchPost(char *query, int origin, int direction)
+{
+    struct editorSearch *s = &E.search;
+    editorSearchInit();
+    editorSearchCancel();
+
+    pthread_mutex_lock(&s->lock);
+    free(s->query);
+    s->qlen = strlen(query);
+    s->query = strdup(query);
+    s->origin = origin;
+    s->direction = direction;
+    s->numrows = E.numrows;
+    s->matches = 0;
+    s->best_row = -1;
+    s->shown_row = -1;
+
+    s->nslices = E.numrows / KILO_SEARCH_SLICE_MIN + 1;
+    if (s->nslices > s->nthreads)
+        s->nslices = s->nthreads;
+
+    if (s->qlen == 0 || E.numrows == 0)
+    {
+        s->nslices = 0;
+    }
     else
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        s->jobgen = __atomic_add_fetch(&s->generation, 1, __ATOMIC_RELAXED);
+        s->pending = s->nslices;
+        pthread_cond_broadcast(&s->work);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
 
-        // This reassignment is needed because editorInsertRow calls realloc
-        // on E.row, and that might move things, invalidating the previous address
-        // try removing this line and pressing enter on a really long line
-        row = &E.row[E.cy];
+void editorSearchRestoreHighlight()
+{
+    struct editorSearch *s = &E.search;
+    if (s->saved_hl)
+    {
+        erow *row = &E.row[s->saved_hl_line];
+        if (row->hl)
+            memcpy(row->hl, s->saved_hl, row->rsize);
+        memFree(MEM_SEARCH, s->saved_hl);
+        s->saved_hl = NULL;
+    }
+}
+
+// move the cursor to the nearest match found so far and update the count
+// returns 1 if the screen needs repainting
+int editorSearchPoll()
+{
+    struct editorSearch *s = &E.search;
+    if (!s->active)
+        return 0;
 
-        row->size = E.cx;
-        row->chars[E.cx] = '\0';
-        // don't need to call this for the new row (E.cy + 1)
-        // because editorInsertRow already calls it
-        editorUpdateRow(row);
+    pthread_mutex_lock(&s->lock);
+    int row = s->best_row;
+    int off = s->best_off;
+    int pending = s->pending;
+    long matches = s->matches;
+    pthread_mutex_unlock(&s->lock);
+
+    snprintf(E.statusextra, sizeof(E.statusextra), " [%ld match%s%s]", matches,
+             matches == 1 ? "" : "es", pending ? "..." : "");
+
+    if (row != -1 && (row != s->shown_row || off != s->shown_off))
+    {
+        editorSearchRestoreHighlight();
+        s->shown_row = row;
+        s->shown_off = off;
+        s->last_match = row;
+
+        erow *r = &E.row[row];
+        editorRowEnsureRender(r);
+        E.cy = row;
+        E.cx = off;
+        E.rowoff = E.numrows; // Scroll all the way to the bottom, so when the screen refreshes the cursor is at the start
+
+        int rx = editorRowCxToRenderOff(r, off);
+        int rxend = editorRowCxToRenderOff(r, off + s->qlen);
+        s->saved_hl_line = row;
+        s->saved_hl = memMalloc(MEM_SEARCH, r->rsize); // this gets freed when the next match is shown
+        memcpy(s->saved_hl, r->hl, r->rsize);
+        memset(&r->hl[rx], HL_MATCH, rxend - rx);
     }
-    E.cx = 0;
-    E.cy++;
+    return 1;
 }
 
-void editorDelChar()
+void editorFindCallback(char * query, int key)
 {
-    if (E.cy == E.numrows)
-        return;
-    else if (E.cy == 0 && E.cx == 0)
-        return;
-    
+    struct editorSearch *s = &E.search;
+    static int direction = 1;
 
-    
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) // if there's a character at the left of the cursor (cursor not at 0)
+    editorSearchRestoreHighlight();
+
+    if (key == '\r' || key == '\x1b')
+    {
+        editorSearchCancel();
+        s->active = 0;
+        s->last_match = -1;
+        E.statusextra[0] = '\0';
+        direction = 1;
+        return;
+    }
+    else if (key == ARROW_UP || key == ARROW_LEFT)
+    {
+        direction = -1;
+    }
+    else if (key == ARROW_DOWN || key == ARROW_RIGHT)
     {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        direction = 1;
     }
     else
     {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        s->last_match = -1;
+        direction = 1;
     }
-}
-/** File i/o **/
-char *editorRowsToString(int *buflen)
-{
-    // creates a string with all rows
-    int j;
-    int totlen = 0;
 
-    // calculate the amount of memory
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1; // 1 for the \n at every line
+    if (s->last_match == -1)
+        direction = 1;
 
-    *buflen = totlen;
+    s->active = 1;
+    editorSearchPost(query, s->last_match, direction);
+    editorSearchPoll();
+}
+
+void editorFind()
+{
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+    int saved_voff = E.wrap.voff;
     
-    char *buf = malloc(totlen);
-    char *p = buf; //we will advance p, but buf will remain at the start
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
 
-    for (j = 0; j < E.numrows; j++)
+    if (query)
     {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-
+	free(query);
+    }
+    else
+    {
+	E.cx = saved_cx;
+	E.cy = saved_cy;
+	E.coloff = saved_coloff;
+	E.rowoff = saved_rowoff;
+	E.wrap.voff = saved_voff;
     }
+	
 
-    return buf;
 }
-void editorOpen(char *filename)
+
+/** Replace **/
+struct replaceBuf
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    char *b;
+    size_t len;
+    size_t cap;
+};
 
-    editorSelectSyntaxHighlight();
+void replaceBufAppend(struct replaceBuf *rb, const char *s, size_t len)
+{
+    if (rb->len + len > rb->cap)
+    {
+        rb->cap = (rb->len + len) * 2;
+        rb->b = memRealloc(MEM_SCRATCH, rb->b, rb->cap);
+    }
+    memcpy(&rb->b[rb->len], s, len);
+    rb->len += len;
+}
+
+// build the replaced contents of row into rb in a single pass
+// returns the number of matches replaced
+long editorReplaceRow(erow *row, struct replaceBuf *rb, const char *pattern,
+                      int plen, regex_t *re, const char *repl, int rlen)
+{
+    long n = 0;
+    // a cold row is only looked at, it is thawed if something is replaced
+    const char *chars = editorRowPeek(row);
+    const char *p = chars;
+    const char *end = chars + row->size;
+    const char *lastend = NULL;
+    rb->len = 0;
+
+    while (p <= end)
+    {
+        const char *mstart, *mend;
+        if (re)
+        {
+            // REG_STARTEND as a peeked row isn't nul terminated
+            regmatch_t m;
+            m.rm_so = p - chars;
+            m.rm_eo = row->size;
+            if (regexec(re, chars, 1, &m, REG_STARTEND | (p == chars ? 0 : REG_NOTBOL)) != 0)
+                break;
+            mstart = chars + m.rm_so;
+            mend = chars + m.rm_eo;
+        }
+        else
+        {
+            mstart = memmem(p, end - p, pattern, plen);
+            if (!mstart)
+                break;
+            mend = mstart + plen;
+        }
 
-    FILE *fp = fopen(filename, "r");
+        if (mstart == mend && mstart == lastend)
+        {
+            // an empty match right after the previous match doesn't count,
+            // step over one char so we make progress
+            if (mstart == end)
+                break;
+            replaceBufAppend(rb, p, mstart - p + 1);
+            p = mstart + 1;
+            continue;
+        }
 
-    if (!fp)
-        die("fopen");
+        replaceBufAppend(rb, p, mstart - p);
+        replaceBufAppend(rb, repl, rlen);
+        n++;
+        p = lastend = mend;
+    }
+
+    if (n && p < end)
+        replaceBufAppend(rb, p, end - p);
+    return n;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    E.filename = filename;
+// replace every match in the buffer
+// each row is rebuilt in one pass and the rows are re-rendered and
+// re-highlighted in a single sweep, so every touched row is processed once
+long editorReplaceAll(const char *pattern, int regex, const char *repl)
+{
+    regex_t re;
+    if (regex && regcomp(&re, pattern, REG_EXTENDED) != 0)
+        return -1;
 
-    while((linelen = getline(&line, &linecap, fp)) != -1)
+    long long span = traceBegin();
+    struct replaceBuf rb = {NULL, 0, 0};
+    int plen = strlen(pattern);
+    int rlen = strlen(repl);
+    long total = 0;
+    int carry = 0; // the previous row's comment state changed
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    for (int j = 0; j < E.numrows; j++)
     {
-        while(linelen > 0 && (line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
+        erow *row = &E.row[j];
+        long n = editorReplaceRow(row, &rb, pattern, plen, regex ? &re : NULL, repl, rlen);
+        if (n)
         {
-            linelen--;
+            editorRowSetChars(row, rb.b, rb.len);
+            editorUpdateRender(row);
+            total += n;
         }
+        if (n || carry)
+            carry = editorHighlightRow(row);
 
-        editorInsertRow(E.numrows, line, linelen);
+        if (j % KILO_REPLACE_PROGRESS_ROWS == 0 && j)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000;
+            if (ms >= 100)
+            {
+                last = now;
+                editorSetStatusMessage("Replacing... %d%% (%ld matches)",
+                                       (int)((long long)j * 100 / E.numrows), total);
+                editorRefreshScreen();
+            }
+        }
+    }
+
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+        E.cx = E.row[E.cy].size;
+
+    memFree(MEM_SCRATCH, rb.b);
+    if (regex)
+        regfree(&re);
+    traceEnd("replace", span, total);
+    return total;
+}
 
+void editorReplace()
+{
+    char *pattern = editorPrompt("Replace: %s (start with / for regex, ESC to cancel)", NULL);
+    if (!pattern)
+        return;
+
+    int regex = (pattern[0] == '/' && pattern[1] != '\0');
+    char *repl = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (repl)
+    {
+        editorLoadFinish();
+        long n = editorReplaceAll(regex ? pattern + 1 : pattern, regex, repl);
+        if (n == -1)
+            editorSetStatusMessage("Invalid regex: %s", pattern + 1);
+        else
+            editorSetStatusMessage("%ld replacement%s", n, n == 1 ? "" : "s");
+        free(repl);
     }
+    free(pattern);
+}
 
-    E.dirty = 0;
-    free(line);
-    fclose(fp);
+/** Grep **/
+void editorGrepWake()
+{
+    ssize_t n = write(E.grep.wakefd[1], "", 1);
+    (void)n;
+}
 
+// queue paths for the workers, unless the walk they belong to was cancelled
+void editorGrepPush(char **paths, int n, unsigned gen)
+{
+    struct editorGrep *g = &E.grep;
+    int j;
+    pthread_mutex_lock(&g->lock);
+    if (gen != __atomic_load_n(&g->generation, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_unlock(&g->lock);
+        for (j = 0; j < n; j++)
+            free(paths[j]);
+        return;
+    }
+    if (g->ntodo + n > g->todocap)
+    {
+        g->todocap = (g->ntodo + n) * 2;
+        g->todo = realloc(g->todo, sizeof(char *) * g->todocap);
+    }
+    for (j = 0; j < n; j++)
+        g->todo[g->ntodo++] = paths[j];
+    pthread_cond_broadcast(&g->work);
+    pthread_mutex_unlock(&g->lock);
 }
 
-void editorSave()
+// hidden entries are skipped, that keeps out .git and our own sidecars
+void editorGrepDir(const char *path, unsigned gen)
 {
-    if (E.filename == NULL)
+    DIR *d = opendir(path);
+    if (!d)
+        return;
+    char **paths = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
     {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (!E.filename)
+        if (de->d_name[0] == '.')
+            continue;
+        if (n == cap)
         {
-            editorSetStatusMessage("Save aborted");
-            return;
+            cap = cap ? cap * 2 : 16;
+            paths = realloc(paths, sizeof(char *) * cap);
         }
-	editorSelectSyntaxHighlight();
-
+        int len = strlen(path) + strlen(de->d_name) + 2;
+        paths[n] = malloc(len);
+        // paths under the starting directory are shown without "./"
+        if (!strcmp(path, "."))
+            snprintf(paths[n], len, "%s", de->d_name);
+        else
+            snprintf(paths[n], len, "%s/%s", path, de->d_name);
+        n++;
     }
+    closedir(d);
+    if (n)
+        editorGrepPush(paths, n, gen);
+    free(paths);
+}
 
-    int len;
-    char *buf = editorRowsToString(&len); // free this later
+// a path:line:text line for each line of the file with a match, handed
+// to the ui in one go so a file's results stay together
+void editorGrepFile(const char *path, off_t size, int id, unsigned gen)
+{
+    struct editorGrep *g = &E.grep;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    madvise(map, size, MADV_SEQUENTIAL);
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1)
+    const char *end = map + size;
+    char *out = NULL;
+    long outlen = 0, outcap = 0, matches = 0;
+    int plen = strlen(path);
+
+    // binary files would only fill the results with garbage
+    if (!memchr(map, '\0', size < KILO_GREP_PROBE ? size : KILO_GREP_PROBE))
     {
-        if (ftruncate64(fd, len) != -1)
+        const char *p = map, *line_start = map, *m, *nl;
+        int line = 1;
+        while (p < end && __atomic_load_n(&g->generation, __ATOMIC_RELAXED) == gen)
         {
-            if (write(fd, buf, len) == len)
+            if (g->regex)
             {
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                E.dirty = 0;
-                return;
+                // REG_STARTEND saves copying lines out to nul terminate them
+                regmatch_t rm;
+                rm.rm_so = p - map;
+                rm.rm_eo = size;
+                if (regexec(&g->re[id], map, 1, &rm, REG_STARTEND) != 0)
+                    break;
+                m = map + rm.rm_so;
+            }
+            else
+            {
+                m = memmem(p, end - p, g->pattern, g->plen);
+                if (!m)
+                    break;
             }
 
+            while ((nl = memchr(line_start, '\n', m - line_start)) != NULL)
+            {
+                line++;
+                line_start = nl + 1;
+            }
+            const char *line_end = memchr(m, '\n', end - m);
+            if (!line_end)
+                line_end = end;
+            int len = line_end - line_start;
+            if (len && line_start[len - 1] == '\r')
+                len--;
+            if (len > KILO_GREP_LINE_MAX)
+                len = KILO_GREP_LINE_MAX;
+
+            if (outlen + plen + len + 16 > outcap)
+            {
+                outcap = (outlen + plen + len + 16) * 2;
+                out = realloc(out, outcap);
+            }
+            outlen += sprintf(out + outlen, "%s:%d:", path, line);
+            memcpy(out + outlen, line_start, len);
+            outlen += len;
+            out[outlen++] = '\n';
+            matches++;
+
+            // one result per line, go on from the next
+            p = line_start = line_end + 1;
+            line++;
         }
+    }
+    munmap(map, size);
 
-        close(fd);
+    pthread_mutex_lock(&g->lock);
+    if (gen == g->generation)
+    {
+        if (g->outlen + outlen > g->outcap)
+        {
+            g->outcap = (g->outlen + outlen) * 2;
+            g->out = realloc(g->out, g->outcap);
+        }
+        if (outlen)
+            memcpy(g->out + g->outlen, out, outlen);
+        g->outlen += outlen;
+        g->files++;
+        g->matches += matches;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    pthread_mutex_unlock(&g->lock);
+    free(out);
+    if (matches)
+        editorGrepWake();
 }
-void editorFindCallback(char * query, int key)
+
+void editorGrepPath(const char *path, int id, unsigned gen)
 {
-    static int last_match = -1;
-    static int direction = 1;
+    struct stat st;
+    if (lstat(path, &st) == -1)
+        return;
+    if (S_ISDIR(st.st_mode))
+        editorGrepDir(path, gen);
+    else if (S_ISREG(st.st_mode) && st.st_size > 0)
+        editorGrepFile(path, st.st_size, id, gen);
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+// workers take directories and files alike off the queue, so the walk
+// itself is spread over them too
+void *editorGrepWorker(void *arg)
+{
+    struct editorGrep *g = &E.grep;
+    int id = (int)(intptr_t)arg;
 
-    if (saved_hl)
+    pthread_mutex_lock(&g->lock);
+    while (1)
     {
-	memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-	free(saved_hl);
-	saved_hl = NULL;
+        while (g->ntodo == 0)
+            pthread_cond_wait(&g->work, &g->lock);
+        char *path = g->todo[--g->ntodo];
+        unsigned gen = g->generation;
+        g->busy++;
+        pthread_mutex_unlock(&g->lock);
+
+        long long span = traceBegin();
+        editorGrepPath(path, id, gen);
+        traceEnd("grep path", span, 1);
+        free(path);
+
+        pthread_mutex_lock(&g->lock);
+        if (--g->busy == 0 && g->ntodo == 0)
+        {
+            pthread_cond_broadcast(&g->done);
+            editorGrepWake();
+        }
     }
-    
-    if (key == '\r' || key == '\x1b')
+    return NULL;
+}
+
+void editorGrepInit()
+{
+    struct editorGrep *g = &E.grep;
+    if (g->nthreads)
+        return;
+
+    if (pipe2(g->wakefd, O_NONBLOCK | O_CLOEXEC) == -1)
+        die("pipe2");
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->work, NULL);
+    pthread_cond_init(&g->done, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (ncpu > KILO_SEARCH_MAX_THREADS)
+        ncpu = KILO_SEARCH_MAX_THREADS;
+
+    for (g->nthreads = 0; g->nthreads < ncpu; g->nthreads++)
     {
-	last_match = -1;
-	direction = 1;
-	return;
+        if (pthread_create(&g->threads[g->nthreads], NULL, editorGrepWorker,
+                           (void *)(intptr_t)g->nthreads) != 0)
+        {
+            if (g->nthreads == 0)
+                die("pthread_create");
+            break;
+        }
     }
-    else if (key == ARROW_UP || key == ARROW_LEFT)
+}
+
+// stop the walk in flight and wait until no worker uses the pattern
+void editorGrepCancel()
+{
+    struct editorGrep *g = &E.grep;
+    if (!g->nthreads)
+        return;
+
+    pthread_mutex_lock(&g->lock);
+    __atomic_add_fetch(&g->generation, 1, __ATOMIC_RELAXED);
+    while (g->ntodo > 0)
+        free(g->todo[--g->ntodo]);
+    while (g->busy > 0)
+        pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// start walking the current directory. returns -1 if the regex is bad
+int editorGrepPost(const char *pattern, int regex)
+{
+    struct editorGrep *g = &E.grep;
+    editorGrepInit();
+    editorGrepCancel();
+
+    int j;
+    if (g->regex)
+        for (j = 0; j < g->nthreads; j++)
+            regfree(&g->re[j]);
+    g->regex = 0;
+    if (regex)
     {
-	direction = -1;
+        for (j = 0; j < g->nthreads; j++)
+        {
+            if (regcomp(&g->re[j], pattern, REG_EXTENDED | REG_NEWLINE) != 0)
+            {
+                while (j-- > 0)
+                    regfree(&g->re[j]);
+                return -1;
+            }
+        }
+        g->regex = 1;
     }
-    else if (key == ARROW_DOWN || key == ARROW_RIGHT)
+
+    free(g->pattern);
+    g->pattern = strdup(pattern);
+    g->plen = strlen(pattern);
+    g->outlen = 0;
+    g->files = 0;
+    g->matches = 0;
+    char *root = strdup(".");
+    editorGrepPush(&root, 1, g->generation);
+    return 0;
+}
+
+// move the results that came in since last time into their buffer.
+// returns 1 if the screen needs repainting
+int editorGrepPoll()
+{
+    struct editorGrep *g = &E.grep;
+    if (g->buffer == -1)
+        return 0;
+    // the swap below can't happen under a search, see editorWaitForInput
+    if (g->buffer != E.curbuf && E.search.active)
+        return 0;
+
+    pthread_mutex_lock(&g->lock);
+    long len = g->outlen - g->shown;
+    char *chunk = len ? memMalloc(MEM_SCRATCH, len) : NULL;
+    if (len)
+        memcpy(chunk, g->out + g->shown, len);
+    int busy = g->busy || g->ntodo;
+    long files = g->files, matches = g->matches;
+    pthread_mutex_unlock(&g->lock);
+
+    if (len)
     {
-	direction = 1;
+        int shown = E.curbuf;
+        editorBufferUse(g->buffer);
+        // the rows aren't edits, the buffer stays as clean as it was
+        int dirty = E.dirty;
+        pthread_rwlock_wrlock(&E.rowlock);
+        editorInsertRows(E.numrows, chunk, len - 1);
+        pthread_rwlock_unlock(&E.rowlock);
+        E.dirty = dirty;
+        g->shown += len;
+        editorBufferUse(shown);
+        memFree(MEM_SCRATCH, chunk);
+        editorEnforceBudget();
     }
-    else
+    editorSetStatusMessage("Grep %s: %ld line%s, %ld file%s searched%s", g->pattern, matches,
+                           matches == 1 ? "" : "s", files, files == 1 ? "" : "s",
+                           busy ? "..." : g->buffer == E.curbuf ? ", Enter opens one" : "");
+    return 1;
+}
+
+// show the results buffer emptied for a new search, making one if
+// there is none
+void editorGrepShow()
+{
+    struct editorGrep *g = &E.grep;
+    if (g->buffer == -1)
     {
-	last_match = -1;
-	direction = 1;
+        editorBufferNew();
+        g->buffer = E.curbuf;
     }
+    editorBufferSwitch(g->buffer);
+    editorCloseFile();
+    g->shown = 0;
+    editorGrepPoll();
+}
 
-    if (last_match == -1)
-	direction = 1;
-    int current = last_match;
-    
-    int i;
-    for (i = 0; i < E.numrows; i++)
-    {
-	// We still loop numrows (the entire file), but we start
-	// from current (the last match) goint up or down according
-	// to direction
-	current += direction;
-	if (current == -1)
-	    current = E.numrows - 1; // wraps around the beginning
-	else if (current == E.numrows)
-	    current = 0; // wraps around the end
-	
-	erow *row = &E.row[current];
-	char *match = strstr(row->render, query);
-
-	if (match)
-	{
-	    last_match = current;
-	    E.cy = current;
-	    E.cx = editorRowRxToCx(row, match - row->render);
-	    E.rowoff = E.numrows; // Scroll all the way to the bottom, so when the screen refreshes the cursor is at the start
-	    
-	    saved_hl_line = current;
-	    saved_hl = malloc(row->rsize); // this gets freed when 
-	    memcpy(saved_hl, row->hl, row->rsize);
-	    memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-	    break;
+// open the file of the result under the cursor at its line
+void editorGrepOpen()
+{
+    if (E.cy >= E.numrows)
+        return;
+    erow *row = &E.row[E.cy];
+    const char *chars = editorRowPeek(row);
 
-	}
+    // the path may have colons in it too, the first :digits: ends it
+    int i, j, line = 0;
+    for (i = 0; i < row->size; i++)
+    {
+        if (chars[i] != ':')
+            continue;
+        for (j = i + 1, line = 0; j < row->size && isdigit((unsigned char)chars[j]); j++)
+            line = line * 10 + chars[j] - '0';
+        if (j > i + 1 && j < row->size && chars[j] == ':')
+            break;
     }
-    
+    if (i == row->size || i == 0)
+    {
+        editorSetStatusMessage("Not a grep result");
+        return;
+    }
+
+    char *path = strndup(chars, i);
+    int opened = editorBufferOpen(path);
+    free(path);
+    if (opened == -1)
+        return;
+    if (line > E.numrows)
+        editorLoadFinish();
+    E.cy = line - 1 < E.numrows ? line - 1 : E.numrows - 1;
+    if (E.cy < 0)
+        E.cy = 0;
+    E.cx = 0;
+    editorSetStatusMessage("Ctrl-G goes back to the results");
 }
 
-void editorFind()
+// Ctrl-G: back to the results from another buffer, a new search of the
+// files under the current directory from the results
+void editorGrep()
 {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-    
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-
-    if (query)
+    struct editorGrep *g = &E.grep;
+    if (g->buffer != -1 && g->buffer != E.curbuf)
     {
-	free(query);
+        editorBufferSwitch(g->buffer);
+        return;
     }
+
+    char *pattern = editorPrompt("Grep: %s (start with / for regex, ESC to cancel)", NULL);
+    if (!pattern)
+        return;
+    int regex = (pattern[0] == '/' && pattern[1] != '\0');
+    if (editorGrepPost(regex ? pattern + 1 : pattern, regex) == -1)
+        editorSetStatusMessage("Invalid regex: %s", pattern + 1);
     else
+        editorGrepShow();
+    free(pattern);
+
+    // headless runs want every result in before the next key
+    if (E.headless)
     {
-	E.cx = saved_cx;
-	E.cy = saved_cy;
-	E.coloff = saved_coloff;
-	E.rowoff = saved_rowoff;
+        pthread_mutex_lock(&g->lock);
+        while (g->busy || g->ntodo)
+            pthread_cond_wait(&g->done, &g->lock);
+        pthread_mutex_unlock(&g->lock);
+        editorGrepPoll();
     }
-	
-
 }
 
 /** Append buffer */
 void abAppend(struct abuf *ab, char *s, int len)
 {
-    char *new = realloc(ab->b, ab->len + len);
+    char *new = memRealloc(MEM_OUTPUT, ab->b, ab->len + len);
 
     if (new == NULL)
         return;
@@ -956,7 +6418,7 @@ void abAppend(struct abuf *ab, char *s, int len)
 
 void abFree(struct abuf *ab)
 {
-    free(ab->b);
+    memFree(MEM_OUTPUT, ab->b);
 }
 
 /** Output **/
@@ -972,15 +6434,46 @@ void editorSetStatusMessage(const char *fmt, ...)
 
 }
 
+// soft wrapped, the view scrolls by screen lines and never sideways
+void editorWrapScroll()
+{
+    struct editorWrap *w = &E.wrap;
+    editorWrapSync();
+    int col, v = editorWrapCursorLine(&col);
+    if (E.rowoff >= E.numrows && E.numrows)
+        w->voff = v; // a search match goes to the top of the screen
+    if (v < w->voff)
+        w->voff = v;
+    else if (v >= w->voff + E.screenrows)
+        w->voff = v - E.screenrows + 1;
+
+    E.rowoff = editorWrapFind(w->voff);
+    E.coloff = 0;
+    w->cur_y = v - w->voff;
+    w->cur_x = col;
+}
+
 void editorScroll()
 {
+    // a search or an undo can take the cursor into a fold
+    if (editorFoldHidden(E.cy))
+        editorFoldReveal(E.cy);
+    if (E.wrap.on)
+    {
+        editorWrapScroll();
+        return;
+    }
     E.rx = 0;
     if (E.cy < E.numrows)
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-    if (E.cy < E.rowoff)
+    // screen lines, which skip folded rows
+    int v = editorFoldVisible(E.cy), top = editorFoldVisible(E.rowoff);
+    if (v < top)
         E.rowoff = E.cy;
-    else if (E.cy >= E.rowoff + E.screenrows)
-        E.rowoff = E.cy - E.screenrows + 1; // go back 1 screen from E.cy, so that it is now in the middle
+    else if (v >= top + E.screenrows)
+        E.rowoff = editorFoldRowAt(v - E.screenrows + 1); // go back 1 screen from E.cy, so that it is now in the middle
+    else
+        E.rowoff = editorFoldRowAt(top); // a fold closed over it
     
     if (E.rx < E.coloff)
         E.coloff = E.rx;
@@ -995,7 +6488,13 @@ void editorDrawStatusBar(struct abuf *ab)
     abAppend(ab, "\x1b[7m", 4);
 
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No name]", E.numrows, (E.dirty > 0) ? "(modified)" : "");
+    char loading[24] = "";
+    if (E.load->active && E.load->size)
+        snprintf(loading, sizeof(loading), " loading %d%%", (int)(E.load->off * 100 / E.load->size));
+    char buffers[32] = "";
+    if (E.nbufs > 1)
+        snprintf(buffers, sizeof(buffers), " [%d/%d]", E.curbuf + 1, E.nbufs);
+    int len = snprintf(status, sizeof(status), "%.20s%s - %d lines%s %s", E.filename ? E.filename : E.grep.buffer == E.curbuf ? "[grep]" : "[No name]", buffers, E.numrows, loading, (E.dirty > 0) ? "(modified)" : "");
     int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
 
     if (len > E.screencols)
@@ -1031,133 +6530,361 @@ void editorDrawMessageBar(struct abuf *ab)
     if (msglen > E.screencols)
         msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
+    {
         abAppend(ab, E.statusmsg, msglen);
+        int extralen = strlen(E.statusextra);
+        if (extralen > E.screencols - msglen)
+            extralen = E.screencols - msglen;
+        abAppend(ab, E.statusextra, extralen);
+    }
 
 }
 
-void editorDrawRows(struct abuf *ab)
+// draw screen line y, without clearing the rest of the line
+void editorDrawRow(struct abuf *ab, int y)
 {
-    int y;
-    for (y = 0; y < E.screenrows; y++)
+    int filerow = editorFoldRowAt(editorFoldVisible(E.rowoff) + y);
+    int sub = 0; // which of the row's lines, when soft wrapping
+    if (E.wrap.on)
+    {
+        int v = E.wrap.voff + y;
+        filerow = editorWrapFind(v);
+        if (filerow < E.numrows)
+            sub = v - editorWrapPrefix(filerow);
+    }
+    // E.numrows = rows in current file
+    // so we only print the default stuff (~)
+    // after we printed the whole file
+    if (filerow >= E.numrows)
+    {
+        if (E.numrows == 0 && !E.load->active && filerow == E.screenrows / 3)
+        {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
+
+            if (welcomelen > E.screencols)
+                welcomelen = E.screencols;
+
+            int padding = (E.screencols - welcomelen) / 2;
+            if (padding)
+            {
+                abAppend(ab, "~", 1);
+                padding--;
+            }
+            while (padding--)
+                abAppend(ab, " ", 1);
+            abAppend(ab, welcome, welcomelen);
+
+        }
+        else
+        {
+            abAppend(ab, "~", 1);
+        }
+    }
+    else
     {
-        int filerow = E.rowoff + y;
-        // E.numrows = rows in current file
-        // so we only print the default stuff (~)
-        // after we printed the whole file
-        if (filerow >= E.numrows)
+        erow *row = &E.row[filerow];
+        editorRowEnsureRender(row);
+        char *c = row->render;
+        unsigned char *hl = row->hl;
+        int end = E.coloff + E.screencols;
+        int j, col, n, cp, w;
+
+        // find the first character on screen, ascii rows just index
+        if (E.wrap.on)
+        {
+            editorWrapLineStart(row, sub, &j);
+            col = 0;
+            end = E.screencols;
+        }
+        else if (row->ascii || E.coloff == 0)
         {
-            if (E.numrows == 0 && filerow == E.screenrows / 3)
+            j = E.coloff < row->rsize ? E.coloff : row->rsize;
+            col = E.coloff;
+        }
+        else
+        {
+            for (j = 0, col = 0; j < row->rsize; j += n, col += w)
+            {
+                n = utf8Decode(&c[j], row->rsize - j, &cp);
+                w = utf8IsControl(cp) ? 1 : utf8Width(cp);
+                if (col + w > E.coloff)
+                    break;
+            }
+            // a wide character cut by the left edge shows as blanks
+            if (j < row->rsize && col < E.coloff)
             {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
+                for (int k = E.coloff; k < col + w; k++)
+                    abAppend(ab, " ", 1);
+                col += w;
+                j += n;
+            }
+        }
 
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
+        int current_color = -1;
+        for (; j < row->rsize; j += n)
+        {
+            cp = (unsigned char)c[j];
+            n = 1;
+            if (!row->ascii)
+                n = utf8Decode(&c[j], row->rsize - j, &cp);
+            w = utf8IsControl(cp) ? 1 : utf8Width(cp);
+            if (col + w > end)
+                break;
+            col += w;
+
+            // the bracket at the cursor and its partner
+            struct editorBrackets *br = &E.brackets;
+            int paired = (filerow == br->row[0] && j == br->off[0]) ||
+                         (filerow == br->row[1] && j == br->off[1]);
+            if (paired)
+                abAppend(ab, "\x1b[7m", 4);
+
+            if (utf8IsControl(cp))
+            {
+                // in ascii, alphabet comes after '@'
+                // so here we convert the ctrl char to printable alphabet letter
+                char sym = (cp >= 0 && cp < 26) ? '@' + cp : '?';
+                abAppend(ab, "\x1b[7m", 4); // invert colors when printing ctrl characters
+                abAppend(ab, &sym, 1);
+                abAppend(ab, "\x1b[m", 3); // return to normal mode
+
+                if (current_color != -1)
+                {
+                    // the last terminal control sequence turns off formatting
+                    // so we have to turn it on again
+                    char buf[16];
+                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                    abAppend(ab, buf, clen);
 
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
+                }
+            }
+            else if (hl[j] == HL_NORMAL)
+            {
+                if (current_color != -1)
                 {
-                    abAppend(ab, "~", 1);
-                    padding--;
+                    abAppend(ab, "\x1b[39m", 5);
+                    current_color = -1;
                 }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
 
+                abAppend(ab, &c[j], n);
             }
             else
             {
-                abAppend(ab, "~", 1);
+                int color = editorSyntaxToColor(hl[j]);
+                if (color != current_color)
+                {
+                    current_color = color;
+                    char buf[16];
+                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                    abAppend(ab, buf, clen);
+                }
+                abAppend(ab, &c[j], n);
             }
+            if (paired)
+                abAppend(ab, "\x1b[27m", 5);
         }
-        else
+        abAppend(ab, "\x1b[39m", 5);
+
+        // a closed fold says how much it hides after its first row
+        int fold = j >= row->rsize ? editorFoldFind(filerow) : -1;
+        if (fold != -1)
         {
-            // we use this variable (instead of changing
-            // E.row.size directly) to not lose the original
-            // value of E.row.size
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols)
-                len = E.screencols;
+            char mark[32];
+            int mlen = snprintf(mark, sizeof(mark), " +%d", E.folds.all[fold].end - filerow);
+            if (col + mlen <= end)
+            {
+                abAppend(ab, "\x1b[7m", 4);
+                abAppend(ab, mark, mlen);
+                abAppend(ab, "\x1b[m", 3);
+            }
+        }
+    }
+}
 
-	    char *c = &E.row[filerow].render[E.coloff];
-	    unsigned char *hl = &E.row[filerow].hl[E.coloff];
+// FNV-1a, to tell whether a screen line changed since the last frame
+uint64_t editorHashBytes(const char *s, int len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-	    int current_color = -1;
-	    int j;
-	    for (j = 0; j < len; j++)
-	    {
-		if (iscntrl(c[j]))
-		{
-		    // in ascii, alphabet comes after '@'
-		    // so here we convert the ctrl char to printable alphabet letter
-		    char sym = (c[j] < 26) ? '@' + c[j] : '?';
-		    abAppend(ab, "\x1b[7m", 4); // invert colors when printing ctrl characters
-		    abAppend(ab, &sym, 1);
-		    abAppend(ab, "\x1b[m", 3); // return to normal mode
-
-		    if (current_color != -1)
-		    {
-			// the last terminal control sequence turns off formatting
-			// so we have to turn it on again
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-			abAppend(ab, buf, clen);
-			
-		    }
-		}
-		else if (hl[j] == HL_NORMAL)
-		{
-		    if (current_color != -1)
-		    {
-			abAppend(ab, "\x1b[39m", 5);
-			current_color = -1;
-		    }
+// forget what is on the terminal, so the next frame repaints everything
+void editorInvalidateFrame()
+{
+    if (E.frame.hash)
+        memset(E.frame.hash, 0, sizeof(uint64_t) * E.frame.rows);
+}
 
-		    abAppend(ab, &c[j], 1);
-		}
-		else
-		{
-		    int color = editorSyntaxToColor(hl[j]);
-		    if (color != current_color)
-		    {
-			current_color = color;
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-			abAppend(ab, buf, clen);
-		    }
-		    abAppend(ab, &c[j], 1);
-		}
-	    }
-	    abAppend(ab, "\x1b[39m", 5);
-        }
+// if the view only moved vertically, let the terminal shift the lines it
+// already shows (DECSTBM + SU/SD), so only the exposed lines get repainted
+void editorScrollFrame(struct abuf *ab)
+{
+    struct editorFrame *f = &E.frame;
+    if (f->rows != E.screenrows)
+    {
+        f->hash = memRealloc(MEM_OUTPUT, f->hash, sizeof(uint64_t) * E.screenrows);
+        f->rows = E.screenrows;
+        editorInvalidateFrame();
+    }
+    else
+    {
+        int shift = (E.wrap.on ? E.wrap.voff : editorFoldVisible(E.rowoff)) - f->rowoff;
+        int n = shift > 0 ? shift : -shift;
+        if (shift && n < f->rows && E.coloff == f->coloff)
+        {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                               f->rows, n, shift > 0 ? 'S' : 'T');
+            abAppend(ab, buf, len);
 
+            if (shift > 0)
+            {
+                memmove(f->hash, f->hash + n, sizeof(uint64_t) * (f->rows - n));
+                memset(f->hash + f->rows - n, 0, sizeof(uint64_t) * n);
+            }
+            else
+            {
+                memmove(f->hash + n, f->hash, sizeof(uint64_t) * (f->rows - n));
+                memset(f->hash, 0, sizeof(uint64_t) * n);
+            }
+        }
+    }
+    f->rowoff = E.wrap.on ? E.wrap.voff : editorFoldVisible(E.rowoff);
+    f->coloff = E.coloff;
+}
 
+// draw only the screen lines that differ from the last frame
+void editorDrawRows(struct abuf *ab)
+{
+    struct abuf line = ABUF_INIT;
+    int y;
+    for (y = 0; y < E.screenrows; y++)
+    {
+        line.len = 0;
+        editorDrawRow(&line, y);
+        uint64_t h = editorHashBytes(line.b, line.len);
+        if (h == E.frame.hash[y])
+            continue;
+        E.frame.hash[y] = h;
+
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+        abAppend(ab, buf, len);
+        abAppend(ab, line.b, line.len);
         abAppend(ab, "\x1b[K", 3); // clear rest of line
-        abAppend(ab, "\r\n", 2);
     }
-
+    abFree(&line);
 }
 
 void editorRefreshScreen()
 {
+    if (E.macro.replaying)
+        return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long span = traceBegin();
     editorScroll();
+    editorBracketMatch();
     struct abuf ab = ABUF_INIT;
+    abAppend(&ab, "\x1b[?2026h", 8); // begin synchronized update, so the frame shows at once
     abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-    abAppend(&ab, "\x1b[H", 3); // go to start
 
+    editorScrollFrame(&ab);
+    long long draw = editorNowNs();
     editorDrawRows(&ab);
+    latencyRecord(LAT_DRAW, editorNowNs() - draw);
+
+    char pos[32];
+    int poslen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.screenrows + 1);
+    abAppend(&ab, pos, poslen);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1); // position cursor
+    if (E.wrap.on)
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.wrap.cur_y + 1, E.wrap.cur_x + 1);
+    else
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editorFoldVisible(E.cy) - editorFoldVisible(E.rowoff) + 1,
+                 E.rx - E.coloff + 1); // position cursor
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6); // show cursor
-    write(STDOUT_FILENO, ab.b, ab.len);
+    abAppend(&ab, "\x1b[?2026l", 8); // end synchronized update
+
+    traceEnd("frame", span, ab.len);
+    struct timespec built, now;
+    clock_gettime(CLOCK_MONOTONIC, &built);
+    span = traceBegin();
+    write(E.outfd, ab.b, ab.len);
+    traceEnd("write", span, ab.len);
     abFree(&ab);
+
+    struct editorFrame *f = &E.frame;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    f->last_build_ns = (built.tv_sec - start.tv_sec) * 1000000000L + (built.tv_nsec - start.tv_nsec);
+    f->last_write_ns = (now.tv_sec - built.tv_sec) * 1000000000L + (now.tv_nsec - built.tv_nsec);
+    f->frames++;
+    f->bytes += ab.len;
+    f->last_bytes = ab.len;
+    f->last_keys = f->frame_keys;
+    f->frame_keys = 0;
+    f->last_ns = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+    f->last = now;
+    E.tick++;
+    editorEnforceBudget();
+
+    latencyRecord(LAT_WRITE, f->last_write_ns);
+    if (E.latency.key_start)
+    {
+        latencyRecord(LAT_KEY_TO_PAINT, now.tv_sec * 1000000000LL + now.tv_nsec - E.latency.key_start);
+        E.latency.key_start = 0;
+    }
+}
+
+int editorInputPending()
+{
+    // a key script is always readable, but replayed keys stand for
+    // keys typed one at a time, so each one gets its frame
+    if (E.headless)
+        return 0;
+
+    struct pollfd pfd;
+    pfd.fd = E.infd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
+
+// repaint unless more input is already queued and the last frame is recent,
+// so key repeat and pastes don't spend their time drawing stale frames
+void editorScheduleRefresh()
+{
+    struct editorFrame *f = &E.frame;
+    if (f->frame_keys && editorInputPending())
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - f->last.tv_sec) * 1000 + (now.tv_nsec - f->last.tv_nsec) / 1000000;
+        if (ms < KILO_FRAME_MS)
+        {
+            f->skipped++;
+            return;
+        }
+    }
+    editorRefreshScreen();
+}
+
+void editorShowFrameStats()
+{
+    struct editorFrame *f = &E.frame;
+    editorSetStatusMessage("%ld frames, %ld keys, %ld skipped, %lld B/frame | last: %d keys %d B %ld us",
+                           f->frames, f->keys, f->skipped, f->frames ? f->bytes / f->frames : 0,
+                           f->last_keys, f->last_bytes, f->last_ns / 1000);
 }
 
 /** Input **/
@@ -1172,8 +6899,10 @@ char *editorPrompt(char *prompt, void (*callback)(char * buf, int))
     while (1)
     {
         editorSetStatusMessage(prompt, buf); // promt is fstring
-        editorRefreshScreen();
+        editorScheduleRefresh();
         int c = editorReadKey();
+        E.frame.keys++;
+        E.frame.frame_keys++;
         if (c == DELETE_KEY || c == BACKSPACE || c == CTRL_KEY('h'))
         {
             // delete doesn't really matter here because you
@@ -1202,7 +6931,7 @@ char *editorPrompt(char *prompt, void (*callback)(char * buf, int))
                 return buf;
             }
         } 
-        else if (!iscntrl(c) && c < 128) // this ignores ctrl characters
+        else if (c >= 32 && c != 127 && c < 256) // this ignores ctrl characters, utf-8 bytes (all >= 128) go in as is
         {
             if (buflen == bufsize - 1)
             {
@@ -1217,6 +6946,15 @@ char *editorPrompt(char *prompt, void (*callback)(char * buf, int))
     }
 }
 
+// move to row y keeping the cursor's column, so it never ends up
+// inside a multibyte character
+void editorMoveToRow(int y)
+{
+    if (E.cy < E.numrows && y < E.numrows)
+        E.cx = editorRowRxToCx(&E.row[y], editorRowCxToRx(&E.row[E.cy], E.cx));
+    E.cy = y;
+}
+
 void editorMoveCursor(int c)
 {
     erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
@@ -1224,26 +6962,26 @@ void editorMoveCursor(int c)
     {
         case ARROW_UP:
             if (E.cy > 0)
-                E.cy--;
+                editorMoveToRow(editorFoldPrev(E.cy));
             break;
         case ARROW_LEFT:
             if (E.cx > 0)
-                E.cx--;
+                E.cx = editorRowPrevCx(row, E.cx);
             else if (E.cy > 0){
-                E.cy--;
+                E.cy = editorFoldPrev(E.cy);
                 E.cx = E.row[E.cy].size;
             }
             break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows - 1)
-                E.cy++;
+            if (editorFoldNext(E.cy) < E.numrows)
+                editorMoveToRow(editorFoldNext(E.cy));
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size)
-                E.cx++;
+                E.cx = editorRowNextCx(row, E.cx);
             else if (row && E.cx == row->size)
             {
-                E.cy++;
+                E.cy = editorFoldNext(E.cy);
                 E.cx = 0;
             }
             break;
@@ -1256,30 +6994,63 @@ void editorMoveCursor(int c)
     if (E.cx > rowlen)
         E.cx = rowlen;
 }
+
+// the keys don't fit in one status message, Ctrl-U shows the next page
+void editorHelp()
+{
+    static const char *pages[] = {
+        "HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find | Ctrl-U = More keys",
+        "HELP: Ctrl-R = Replace | Ctrl-Z/Ctrl-Y = Undo/Redo | Ctrl-G = Grep",
+        "HELP: Ctrl-O = Open | Ctrl-N = Next file | Ctrl-X = Close file",
+        "HELP: Ctrl-T = Fold | Ctrl-B = Matching bracket | Ctrl-W = Soft wrap",
+        "HELP: Ctrl-K = Record macro | Ctrl-E = Replay macro | Ctrl-P = Stats",
+    };
+    static int page = 0;
+    editorSetStatusMessage("%s", pages[page]);
+    page = (page + 1) % (int)(sizeof(pages) / sizeof(pages[0]));
+}
+
 void editorProcessKeypress()
 {
     static int quit_times = KILO_QUIT_TIMES; // static files get initialized only once
     int key = editorReadKey();
+    E.frame.keys++;
+    E.frame.frame_keys++;
+    // a whole paste undoes as one step
+    if (!E.undo.paste)
+        E.undo.seq++;
 
     switch (key)
     {
         case '\r':
-            editorInsertNewLine();
+            if (E.grep.buffer == E.curbuf)
+                editorGrepOpen();
+            else
+                editorInsertNewLine();
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0)
+            if (editorBuffersDirty() && quit_times > 0)
             {
-                editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                    "Press Ctrl-Q %d more times to quit.", quit_times);
+                if (editorBuffersDirty() == 1)
+                    editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                        "Press Ctrl-Q %d more times to quit.", quit_times);
+                else
+                    editorSetStatusMessage("WARNING!!! %d files have unsaved changes. "
+                        "Press Ctrl-Q %d more times to quit.", editorBuffersDirty(), quit_times);
                 quit_times--;
                 return;
                 // this return makes so it doesn't read the line further below
                 // that increases assigns quit_times to KILO_QUIT_TIMES
 
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[1;1H", 6);
+            for (int k = 0; k < E.nbufs; k++)
+            {
+                editorBufferUse(k);
+                editorJournalDiscard();
+            }
+            write(E.outfd, "\x1b[2J", 4);
+            write(E.outfd, "\x1b[1;1H", 6);
             exit(0);
             break;
         
@@ -1297,17 +7068,25 @@ void editorProcessKeypress()
             break;
         
         case CTRL_KEY('l'):
+            editorInvalidateFrame();
+            break;
+
         case '\x1b':
             break;
 
         case PAGE_UP:
         case PAGE_DOWN:
         {
+            if (E.wrap.on)
+            {
+                editorWrapMoveCursor(key);
+                break;
+            }
             if (key == PAGE_UP)
                 E.cy = E.rowoff;
             else if (key == PAGE_DOWN)
             {
-                E.cy = E.rowoff + E.screenrows - 1;
+                E.cy = editorFoldRowAt(editorFoldVisible(E.rowoff) + E.screenrows - 1);
                 if (E.cy > E.numrows)
                     E.cy = E.numrows;
 
@@ -1331,21 +7110,267 @@ void editorProcessKeypress()
 	    editorFind();
 	    break;
 
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('p'):
+        {
+            // cycle through memory, frame stats and the latency histograms
+            static int page = 0;
+            if (page == 0)
+                editorShowMemory();
+            else if (page == 1)
+                editorShowFrameStats();
+            else
+                editorShowLatency(page == 2 ? LAT_KEY_TO_PAINT : page - 3);
+            page = (page + 1) % (LAT_STAGES + 2);
+            break;
+        }
+
         case ARROW_UP:
-        case ARROW_LEFT:
         case ARROW_DOWN:
+            if (E.wrap.on)
+                editorWrapMoveCursor(key);
+            else
+                editorMoveCursor(key);
+            break;
+        case ARROW_LEFT:
         case ARROW_RIGHT:
             editorMoveCursor(key);
             break;
+
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+
+        case CTRL_KEY('t'):
+            editorToggleFold();
+            break;
+
+        case CTRL_KEY('b'):
+            editorBracketJump();
+            break;
+
+        case CTRL_KEY('g'):
+            editorGrep();
+            break;
+
+        case CTRL_KEY('o'):
+            editorBufferPrompt();
+            break;
+
+        case CTRL_KEY('n'):
+            editorBufferSwitch((E.curbuf + 1) % E.nbufs);
+            break;
+
+        case CTRL_KEY('x'):
+            editorBufferClose();
+            break;
+
+        case CTRL_KEY('k'):
+            editorMacroRecord();
+            break;
+
+        case CTRL_KEY('e'):
+            editorMacroPrompt();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndoStep(1);
+            break;
+
+        case CTRL_KEY('y'):
+            editorUndoStep(0);
+            break;
+
+        case CTRL_KEY('u'):
+            editorHelp();
+            break;
+
+        case PASTE_START:
+            E.undo.paste = 1;
+            break;
+
+        case PASTE_END:
+            E.undo.paste = 0;
+            break;
         
         default:
             editorInsertChar(key);
             break;
     }
 
+    editorCheckPristine();
+    editorDiskCheck();
     quit_times = KILO_QUIT_TIMES;
+    latencyRecord(LAT_PROCESS, editorNowNs() - E.latency.key_ready);
+}
+
+
+/** Macros **/
+// Ctrl-K starts recording the keys read, and stops it
+void editorMacroRecord()
+{
+    struct editorMacro *m = &E.macro;
+    if (m->replaying)
+        return;
+    if (!m->recording)
+    {
+        m->n = 0;
+        m->recording = 1;
+        editorSetStatusMessage("Recording, Ctrl-K to stop");
+        return;
+    }
+    m->recording = 0;
+    m->n--; // the Ctrl-K that stopped it
+    editorSetStatusMessage("Recorded %d key%s, Ctrl-E replays them", m->n, m->n == 1 ? "" : "s");
+}
+
+// rows edited during a replay were left unhighlighted, with their comment
+// state unknown: do them in one pass, carrying comment changes down
+void editorMacroHighlight()
+{
+    long long span = traceBegin();
+    int carry = 0, n = 0;
+    for (int j = 0; j < E.numrows; j++)
+    {
+        erow *row = &E.row[j];
+        if (carry || (row->render && !row->hl))
+        {
+            carry = editorHighlightRow(row);
+            n++;
+        }
+    }
+    traceEnd("macro highlight", span, n);
+}
+
+// run the recorded keys times times without drawing, then draw once. a
+// key typed meanwhile stops it early; the whole run undoes in one step
+void editorMacroReplay(long times)
+{
+    struct editorMacro *m = &E.macro;
+    long long start = editorNowNs();
+    long done;
+    int paste = E.undo.paste;
+
+    m->replaying = 1;
+    m->overrun = 0;
+    E.undo.seq++;
+    E.undo.paste = 1;
+    for (done = 0; done < times && !m->overrun; done++)
+    {
+        if (done % KILO_MACRO_POLL == KILO_MACRO_POLL - 1 && editorInputPending())
+            break;
+        m->pos = 0;
+        while (m->pos < m->n && !m->overrun)
+            editorProcessKeypress();
+    }
+    E.undo.paste = paste;
+    m->replaying = 0;
+    editorMacroHighlight();
+
+    long long ns = editorNowNs() - start;
+    double secs = ns > 0 ? ns / 1e9 : 1e-9;
+    editorSetStatusMessage("Replayed %ld time%s%s: %ld keys in %.1f ms, %.0f keys/s, %.0f runs/s",
+                           done, done == 1 ? "" : "s", m->overrun ? " (ran out of keys)" : "",
+                           done * m->n, ns / 1e6, done * m->n / secs, done / secs);
+}
+
+// Ctrl-E, which is never part of a macro itself: a replay can't start
+// another one
+void editorMacroPrompt()
+{
+    struct editorMacro *m = &E.macro;
+    if (m->replaying)
+        return;
+    if (m->recording)
+    {
+        m->n--; // the Ctrl-E just recorded
+        editorSetStatusMessage("Stop recording with Ctrl-K first");
+        return;
+    }
+    if (m->n <= 0)
+    {
+        editorSetStatusMessage("No macro recorded, Ctrl-K starts one");
+        return;
+    }
+    char *count = editorPrompt("Replay the macro how many times: %s (ESC to cancel)", NULL);
+    if (!count)
+        return;
+    long times = atol(count);
+    free(count);
+    if (times > 0)
+        editorMacroReplay(times);
+}
+
+/** Headless **/
+void editorBenchRecord(long process, long render, long write)
+{
+    struct editorBench *b = &E.bench;
+    if (b->n == b->cap)
+    {
+        b->cap = b->cap ? b->cap * 2 : 1024;
+        b->process = realloc(b->process, sizeof(long) * b->cap);
+        b->render = realloc(b->render, sizeof(long) * b->cap);
+        b->write = realloc(b->write, sizeof(long) * b->cap);
+    }
+    b->process[b->n] = process;
+    b->render[b->n] = render;
+    b->write[b->n] = write;
+    b->n++;
+}
+
+int editorCompareLong(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+void editorBenchReportLine(const char *name, long *samples, int n)
+{
+    qsort(samples, n, sizeof(long), editorCompareLong);
+    fprintf(stderr, "%-8s %10.1f %10.1f %10.1f\n", name,
+            samples[n / 2] / 1000.0, samples[(int)(n * 0.99)] / 1000.0, samples[n - 1] / 1000.0);
+}
+
+void editorBenchReport()
+{
+    struct editorBench *b = &E.bench;
+    if (b->n == 0)
+        return;
+
+    long *total = malloc(sizeof(long) * b->n);
+    for (int i = 0; i < b->n; i++)
+        total[i] = b->process[i] + b->render[i] + b->write[i];
+
+    fprintf(stderr, "%d keys, %ld frames, %lld bytes written\n", b->n, E.frame.frames, E.frame.bytes);
+    fprintf(stderr, "%-8s %10s %10s %10s\n", "(us)", "p50", "p99", "max");
+    editorBenchReportLine("process", b->process, b->n);
+    editorBenchReportLine("render", b->render, b->n);
+    editorBenchReportLine("write", b->write, b->n);
+    editorBenchReportLine("total", total, b->n);
+    free(total);
 }
 
+// replay the key script against the file on a virtual terminal,
+// timing every key until the script runs out
+void editorHeadlessRun()
+{
+    atexit(editorBenchReport);
+    editorRefreshScreen();
+    while (1)
+    {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        editorProcessKeypress();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        editorRefreshScreen();
+
+        long process = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+        editorBenchRecord(process, E.frame.last_build_ns, E.frame.last_write_ns);
+    }
+}
 
 /** Init **/
 void initEditor()
@@ -1358,27 +7383,124 @@ void initEditor()
     E.row = NULL;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
+    E.statusextra[0] = '\0';
     E.statusmsg_time = 0;
     E.dirty = 0;
     E.syntax = NULL;
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    E.search.wakefd[0] = E.search.wakefd[1] = -1;
+    E.search.last_match = -1;
+    E.journal.fd = -1;
+    E.undo.open = -1;
+    E.follow.ifd = E.follow.fd = -1;
+    E.load = calloc(1, sizeof(struct editorLoad));
+    E.bufs = memMalloc(MEM_ROWS, sizeof(struct editorBuffer));
+    E.nbufs = 1;
+    E.curbuf = 0;
+    E.shownbuf = 0;
+    E.grep.buffer = -1;
+    pthread_rwlock_init(&E.rowlock, NULL);
+    if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
     
     E.screenrows -= 2; // One of the lines is reserved as the status bar
 
 }
+// the microbenchmarks include this file and bring their own main
+#ifndef KILO_NO_MAIN
+void usage()
+{
+    fprintf(stderr, "Usage: kilo [--mem-report] [--mem-budget MB] [--undo-mb MB] [--follow] [--latency FILE] [--trace FILE] [--headless ROWSxCOLS --script KEYS [--capture OUT]] [file...]\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    enableRawMode();
+    char *files[argc];
+    int nfiles = 0;
+    char *script = NULL;
+    char *capture = NULL;
+    int mem_report = 0;
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    E.undo.cap = (long long)KILO_UNDO_CAP_MB * 1024 * 1024;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc)
+        {
+            E.headless = 1;
+            if (sscanf(argv[++i], "%dx%d", &E.screenrows, &E.screencols) != 2 ||
+                E.screenrows < 3 || E.screencols < 1)
+                usage();
+        }
+        else if (!strcmp(argv[i], "--script") && i + 1 < argc)
+            script = argv[++i];
+        else if (!strcmp(argv[i], "--capture") && i + 1 < argc)
+            capture = argv[++i];
+        else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+            E.latency.dump_path = argv[++i];
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            E.trace_path = argv[++i];
+        else if (!strcmp(argv[i], "--mem-report"))
+            mem_report = 1;
+        else if (!strcmp(argv[i], "--mem-budget") && i + 1 < argc)
+            E.mem_budget = atoll(argv[++i]) * 1024 * 1024;
+        else if (!strcmp(argv[i], "--undo-mb") && i + 1 < argc)
+            E.undo.cap = atoll(argv[++i]) * 1024 * 1024;
+        else if (!strcmp(argv[i], "--follow"))
+            E.follow.on = E.follow.pin = 1;
+        else if (argv[i][0] == '-')
+            usage();
+        else
+            files[nfiles++] = argv[i];
+    }
+
+    if (mem_report)
+    {
+        // load the file, print where the memory went and quit
+        E.headless = 1;
+        E.screenrows = 24;
+        E.screencols = 80;
+    }
+    else if (E.headless)
+    {
+        if (!script)
+            usage();
+        E.infd = open(script, O_RDONLY);
+        E.outfd = open(capture ? capture : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (E.infd == -1 || E.outfd == -1)
+            die(script);
+    }
+    else
+    {
+        enableRawMode();
+    }
+
     initEditor();
-    if (argc > 1)
-        editorOpen(argv[1]);
+    atexit(editorIndexWait);
+    if (E.latency.dump_path)
+        atexit(editorLatencyDump);
+    if (E.trace_path)
+        atexit(traceDump);
+    if (nfiles)
+        editorOpen(files[0]);
+    for (int i = 1; i < nfiles; i++)
+        editorBufferOpenHidden(files[i]);
+
+    if (mem_report)
+    {
+        editorMemReport(stdout);
+        return 0;
+    }
+    if (E.headless)
+        editorHeadlessRun();
 
-    editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find");
+    editorHelp();
     while(1)
     {
-        editorRefreshScreen();
+        editorScheduleRefresh();
         editorProcessKeypress();
     }
     return 0;
 }
+#endif
@@ -0,0 +1,110 @@
+// Crash recovery tests for kilo's swap file.
+//
+// Builds the editor core without its main, writes a swap file the way a
+// crashed session would have left it, then opens the file again and
+// answers the recovery question through a pipe. Exits non-zero on the
+// first failed check; build with -fsanitize=address to also catch rows
+// whose hl fell behind their render.
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+int failures = 0;
+
+void check(int ok, const char *what)
+{
+    fprintf(stderr, "%-52s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+// leave path's swap file with a single set-row record for row, as if the
+// editor died right after flushing it
+void writeSwap(const char *path, int row, const char *s, int len)
+{
+    struct editorJournal *j = &E.journal;
+    struct stat st;
+    if (stat(path, &st) == -1)
+        die("stat");
+    free(j->path);
+    j->path = editorSiblingPath(path, ".swp");
+    j->file_size = st.st_size;
+    j->file_mtime = st.st_mtime;
+    j->fd = -1;
+    editorJournalRecord(J_SET_ROW, row, 0, s, len);
+    editorJournalFlush();
+    close(j->fd);
+    j->fd = -1;
+    free(j->path);
+    j->path = NULL;
+}
+
+// open path with a swap file next to it and say yes to recovering it
+void recoverFile(char *path)
+{
+    int keys[2];
+    if (pipe(keys) == -1 || write(keys[1], "y", 1) != 1)
+        die("pipe");
+    E.infd = keys[0];
+    E.headless = 0; // headless runs never look for a swap file
+    editorOpen(path);
+    E.headless = 1;
+    close(keys[0]);
+    close(keys[1]);
+}
+
+// every row's hl covers its render, so drawing it stays in bounds
+int rowsHighlighted()
+{
+    for (int j = 0; j < E.numrows; j++)
+    {
+        erow *row = &E.row[j];
+        if (row->rsize && (!row->hl || malloc_usable_size(row->hl) < (size_t)row->rsize))
+            return 0;
+    }
+    return 1;
+}
+
+void testRecover(const char *dir, const char *name)
+{
+    char path[4096], line[200], msg[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+    fputs("abc\ndef\n", fp);
+    fclose(fp);
+
+    // much longer than the row it replaces, so a stale hl is too short
+    memset(line, 'x', sizeof(line));
+    writeSwap(path, 0, line, sizeof(line));
+    recoverFile(path);
+
+    snprintf(msg, sizeof(msg), "%s: set-row record replayed", name);
+    check(E.numrows == 2 && E.row[0].size == (int)sizeof(line) &&
+          !memcmp(editorRowPeek(&E.row[0]), line, sizeof(line)), msg);
+    snprintf(msg, sizeof(msg), "%s: hl sized to the new render", name);
+    check(rowsHighlighted(), msg);
+    editorRefreshScreen();
+
+    editorCloseFile();
+    unlink(path);
+}
+
+int main()
+{
+    char dir[] = "/tmp/kilo-test-XXXXXX";
+    if (!mkdtemp(dir))
+        die("mkdtemp");
+
+    E.headless = 1;
+    E.screenrows = 24;
+    E.screencols = 80;
+    E.outfd = open("/dev/null", O_WRONLY);
+    initEditor();
+
+    testRecover(dir, "plain.txt"); // no syntax highlights it afterwards
+    testRecover(dir, "code.c");
+
+    rmdir(dir);
+    return failures != 0;
+}